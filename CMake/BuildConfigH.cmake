@@ -4,6 +4,7 @@ include(CheckSymbolExists)
 include(CheckCXXSourceCompiles)
 
 check_include_file(sys/resource.h HAVE_SYS_RESOURCE_H)
+check_include_file(sys/mman.h HAVE_SYS_MMAN_H)
 check_symbol_exists(getrusage sys/resource.h HAVE_GETRUSAGE)
 check_library_exists(readline readline "" HAVE_LIBREADLINE)
 check_library_exists(rt clock_gettime "" HAVE_LIBRT)
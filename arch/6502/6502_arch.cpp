@@ -115,5 +115,7 @@ arch_func_t arch_func_6502 = {
 	// idbg support
 	arch_6502_get_psr,
 	arch_6502_get_reg,
-	NULL
+	NULL,
+	// flag liveness
+	arch_6502_flags_used
 };
@@ -8,3 +8,4 @@ int         arch_6502_tag_instr(cpu_t *cpu, addr_t pc, tag_t *tag, addr_t *new_p
 int         arch_6502_disasm_instr(cpu_t *cpu, addr_t pc, char *line, unsigned int max_line);
 Value      *arch_6502_translate_cond(cpu_t *cpu, addr_t pc, BasicBlock *bb);
 int         arch_6502_translate_instr(cpu_t *cpu, addr_t pc, BasicBlock *bb);
+void        arch_6502_flags_used(cpu_t *cpu, addr_t pc, uint64_t *read, uint64_t *written);
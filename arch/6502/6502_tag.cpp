@@ -54,3 +54,73 @@ arch_6502_tag_instr(cpu_t *cpu, addr_t pc, tag_t *tag, addr_t *new_pc, addr_t *n
 	return length;
 }
 
+
+#define F(f) ((uint64_t)1 << f##_SHIFT)
+#define F_NZ (F(N) | F(Z))
+#define F_ALL ((uint64_t)0xFF)
+
+/* the flags the translated instruction reads and writes */
+void
+arch_6502_flags_used(cpu_t *cpu, addr_t pc, uint64_t *read, uint64_t *written) {
+	uint8_t opcode = cpu->RAM[pc];
+
+	*read = 0;
+	*written = 0;
+	switch (get_instr(opcode)) {
+		case INSTR_CLC:
+		case INSTR_SEC:	*written = F(C);				break;
+		case INSTR_CLD:
+		case INSTR_SED:	*written = F(D);				break;
+		case INSTR_CLI:
+		case INSTR_SEI:	*written = F(I);				break;
+		case INSTR_CLV:	*written = F(V);				break;
+
+		case INSTR_TAX:
+		case INSTR_TAY:
+		case INSTR_TXA:
+		case INSTR_TYA:
+		case INSTR_TSX:
+		case INSTR_TXS:
+		case INSTR_LDA:
+		case INSTR_LDX:
+		case INSTR_LDY:
+		case INSTR_PLA:
+		case INSTR_AND:
+		case INSTR_ORA:
+		case INSTR_EOR:
+		case INSTR_BIT:
+		case INSTR_INX:
+		case INSTR_INY:
+		case INSTR_DEX:
+		case INSTR_DEY:
+		case INSTR_INC:
+		case INSTR_DEC:	*written = F_NZ;				break;
+
+		case INSTR_ASL:
+		case INSTR_LSR:
+		case INSTR_CMP:
+		case INSTR_CPX:
+		case INSTR_CPY:	*written = F_NZ | F(C);		break;
+		case INSTR_ROL:
+		case INSTR_ROR:
+		case INSTR_ADC:
+		case INSTR_SBC:	*read = F(C);	*written = F_NZ | F(C);	break;
+
+		case INSTR_PHP:	*read = F_ALL;					break;
+		case INSTR_PLP:	*written = F_ALL;				break;
+
+		case INSTR_BEQ:
+		case INSTR_BNE:	*read = F(Z);					break;
+		case INSTR_BCS:
+		case INSTR_BCC:	*read = F(C);					break;
+		case INSTR_BMI:
+		case INSTR_BPL:	*read = F(N);					break;
+		case INSTR_BVS:
+		case INSTR_BVC:	*read = F(V);					break;
+
+		/* these leave translated code */
+		case INSTR_BRK:
+		case INSTR_RTI:
+		case INSTR_XXX:	*read = F_ALL;					break;
+	}
+}
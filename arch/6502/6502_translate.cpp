@@ -24,15 +24,16 @@
 
 #define GEP(a) GetElementPtrInst::CreateInBounds(cpu->ptr_RAM, a, "", bb)
 
-#define LOAD_RAM8(a) LOAD(GEP(a))
+#define LOAD_RAM8(a) arch_load8(cpu, a, bb)
 /* explicit little endian load of 16 bits */
 #define LOAD_RAM16(a) OR(ZEXT16(LOAD_RAM8(a)), SHL(ZEXT16(LOAD_RAM8(ADD(a, CONST32(1)))), CONST16(8)))
 
 #define OPERAND_8 cpu->RAM[(pc+1)&0xFFFF]
 #define OPERAND_16 ((cpu->RAM[(pc+1)&0xFFFF] | (cpu->RAM[(pc+2)&0xFFFF]<<8))&0xFFFF)
 
+/* effective address of a memory operand, NULL for the other modes */
 static Value *
-arch_6502_get_operand_lvalue(cpu_t *cpu, addr_t pc, BasicBlock* bb) {
+arch_6502_get_operand_ea(cpu_t *cpu, addr_t pc, BasicBlock* bb) {
 	int am = get_addmode(cpu->RAM[pc]);
 	Value *index_register_before;
 	Value *index_register_after;
@@ -41,16 +42,10 @@ arch_6502_get_operand_lvalue(cpu_t *cpu, addr_t pc, BasicBlock* bb) {
 
 	switch (am) {
 		case ADDMODE_ACC:
-			return GPR(A);
 		case ADDMODE_BRA:
 		case ADDMODE_IMPL:
-			return NULL;
 		case ADDMODE_IMM:
-			{
-			Value *ptr_temp = new AllocaInst(getIntegerType(8), 0, "temp", bb);
-			new StoreInst(CONST8(OPERAND_8), ptr_temp, bb);
-			return ptr_temp;
-			}
+			return NULL;
 	}
 
 	is_indirect = ((am == ADDMODE_IND) || (am == ADDMODE_INDX) || (am == ADDMODE_INDY));
@@ -89,7 +84,43 @@ arch_6502_get_operand_lvalue(cpu_t *cpu, addr_t pc, BasicBlock* bb) {
 	if (index_register_after)
 		ea = ADD(ZEXT32(LOAD(index_register_after)), ea);
 
-	return GEP(ea);
+	return ea;
+}
+
+static Value *
+arch_6502_get_operand_lvalue(cpu_t *cpu, addr_t pc, BasicBlock* bb) {
+	switch (get_addmode(cpu->RAM[pc])) {
+		case ADDMODE_ACC:
+			return GPR(A);
+		case ADDMODE_BRA:
+		case ADDMODE_IMPL:
+			return NULL;
+		case ADDMODE_IMM:
+			{
+			Value *ptr_temp = new AllocaInst(getIntegerType(8), 0, "temp", bb);
+			new StoreInst(CONST8(OPERAND_8), ptr_temp, bb);
+			return ptr_temp;
+			}
+	}
+	return GEP(arch_6502_get_operand_ea(cpu, pc, bb));
+}
+
+/* memory operands go through the frontend, which knows about ROM and MMIO */
+static Value *
+arch_6502_load_operand(cpu_t *cpu, addr_t pc, BasicBlock* bb) {
+	Value *ea = arch_6502_get_operand_ea(cpu, pc, bb);
+	if (ea == NULL)
+		return LOAD(arch_6502_get_operand_lvalue(cpu, pc, bb));
+	return arch_load8(cpu, ea, bb);
+}
+
+static Value *
+arch_6502_store_operand(cpu_t *cpu, Value *v, addr_t pc, BasicBlock* bb) {
+	Value *ea = arch_6502_get_operand_ea(cpu, pc, bb);
+	if (ea == NULL)
+		return STORE(v, arch_6502_get_operand_lvalue(cpu, pc, bb));
+	arch_store8(cpu, v, ea, bb);
+	return v;
 }
 
 static void
@@ -119,12 +150,13 @@ LOG("%s:%d pc=%" PRIx64 " opcode=%x\n", __func__, __LINE__, pc, opcode);
 }
 
 #define LOPERAND arch_6502_get_operand_lvalue(cpu, pc, bb)
-#define OPERAND LOAD(LOPERAND)
+#define OPERAND arch_6502_load_operand(cpu, pc, bb)
+#define STORE_OPERAND(v) arch_6502_store_operand(cpu, v, pc, bb)
 
-/* stack operations */
-#define TOS GEP(OR(ZEXT32(R(S)), CONST32(0x0100)))
-#define PUSH(v) { STORE(v, TOS); LET(S,DEC(R(S))); }
-#define PULL (LET(S,INC(R(S))), LOAD(TOS))
+/* stack operations, through the frontend like the other accesses */
+#define TOS OR(ZEXT32(R(S)), CONST32(0x0100))
+#define PUSH(v) { arch_store8(cpu, v, TOS, bb); LET(S,DEC(R(S))); }
+#define PULL (LET(S,INC(R(S))), LOAD_RAM8(TOS))
 #define PUSH16(v) { PUSH(CONST8((v) >> 8)); PUSH(CONST8((v) & 0xFF)); }
 // Because of a GCC evaluation order problem, the PULL16
 // macro needs to be expanded.
@@ -137,6 +169,18 @@ arch_6502_pull16(cpu_t *cpu, BasicBlock *bb)
 	return (OR(ZEXT16(lo), SHL(ZEXT16(hi), CONST16(8))));
 }
 
+/* shift or rotate A, or the memory operand through the frontend */
+static Value *
+arch_6502_shiftrotate(cpu_t *cpu, addr_t pc, bool left, bool rotate, BasicBlock *bb)
+{
+	if (get_addmode(cpu->RAM[pc]) == ADDMODE_ACC)
+		return SHIFTROTATE(GPR(A), GPR(A), left, rotate);
+
+	Value *ptr_temp = new AllocaInst(getIntegerType(8), 0, "temp", bb);
+	new StoreInst(OPERAND, ptr_temp, bb);
+	return STORE_OPERAND(SHIFTROTATE(ptr_temp, ptr_temp, left, rotate));
+}
+
 int
 arch_6502_translate_instr(cpu_t *cpu, addr_t pc, BasicBlock *bb) {
 	uint8_t opcode = cpu->RAM[pc];
@@ -167,9 +211,9 @@ arch_6502_translate_instr(cpu_t *cpu, addr_t pc, BasicBlock *bb) {
 		case INSTR_LDY:	SET_NZ(LET(Y,OPERAND));			break;
 
 		/* store */
-		case INSTR_STA:	STORE(R(A),LOPERAND);			break;
-		case INSTR_STX:	STORE(R(X),LOPERAND);			break;
-		case INSTR_STY:	STORE(R(Y),LOPERAND);			break;
+		case INSTR_STA:	STORE_OPERAND(R(A));			break;
+		case INSTR_STX:	STORE_OPERAND(R(X));			break;
+		case INSTR_STY:	STORE_OPERAND(R(Y));			break;
 
 		/* stack */
 		case INSTR_PHA:	PUSH(R(A));						break;
@@ -178,10 +222,10 @@ arch_6502_translate_instr(cpu_t *cpu, addr_t pc, BasicBlock *bb) {
 		case INSTR_PLP:	arch_flags_decode(cpu, PULL, bb);	break;
 
 		/* shift */
-		case INSTR_ASL:	SET_NZ(SHIFTROTATE(LOPERAND, LOPERAND, true, false));	break;
-		case INSTR_LSR:	SET_NZ(SHIFTROTATE(LOPERAND, LOPERAND, false, false));	break;
-		case INSTR_ROL:	SET_NZ(SHIFTROTATE(LOPERAND, LOPERAND, true, true));	break;
-		case INSTR_ROR:	SET_NZ(SHIFTROTATE(LOPERAND, LOPERAND, false, true));	break;
+		case INSTR_ASL:	SET_NZ(arch_6502_shiftrotate(cpu, pc, true, false, bb));	break;
+		case INSTR_LSR:	SET_NZ(arch_6502_shiftrotate(cpu, pc, false, false, bb));	break;
+		case INSTR_ROL:	SET_NZ(arch_6502_shiftrotate(cpu, pc, true, true, bb));	break;
+		case INSTR_ROR:	SET_NZ(arch_6502_shiftrotate(cpu, pc, false, true, bb));	break;
 
 		/* bit logic */
 		case INSTR_AND:	SET_NZ(LET(A,AND(R(A),OPERAND)));			break;
@@ -202,8 +246,8 @@ arch_6502_translate_instr(cpu_t *cpu, addr_t pc, BasicBlock *bb) {
 		case INSTR_DEX:	SET_NZ(LET(X,DEC(R(X))));			break;
 		case INSTR_DEY:	SET_NZ(LET(Y,DEC(R(Y))));			break;
 
-		case INSTR_INC:	SET_NZ(STORE(INC(OPERAND),LOPERAND));			break;
-		case INSTR_DEC:	SET_NZ(STORE(DEC(OPERAND),LOPERAND));			break;
+		case INSTR_INC:	SET_NZ(STORE_OPERAND(INC(OPERAND)));			break;
+		case INSTR_DEC:	SET_NZ(STORE_OPERAND(DEC(OPERAND)));			break;
 		
 		/* control flow */
 		case INSTR_JMP:
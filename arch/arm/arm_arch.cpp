@@ -31,6 +31,13 @@ static cpu_register_layout_t arch_arm_register_layout[] = {
 	{ 0, 32, 0, 0, 0, "CPSR" },
 };
 
+// AAPCS: arguments in r0-r3, result in r0, return address in lr
+static cpu_abi_t arch_arm_abi = {
+	4, { 0, 1, 2, 3 },
+	0,
+	14
+};
+
 static void
 arch_arm_init(cpu_t *cpu, cpu_archinfo_t *info, cpu_archrf_t *rf)
 {
@@ -51,11 +58,14 @@ arch_arm_init(cpu_t *cpu, cpu_archinfo_t *info, cpu_archrf_t *rf)
 	info->word_size = 32;
 	info->float_size = 64;
 	info->address_size = 32;
+	// Instructions are 32bits wide.
+	info->instr_align = 4;
 	// There are 16 32-bit GPRs
 	info->regclass_count[CPU_REGCLASS_GPR] = 16;
 	// There is also 1 extra register to handle PSR.
 	info->regclass_count[CPU_REGCLASS_XR] = 1;
 	info->register_layout = arch_arm_register_layout;
+	info->abi = &arch_arm_abi;
 
 	reg_arm_t *reg;
 	reg = (reg_arm_t*)malloc(sizeof(reg_arm_t));
@@ -112,5 +122,7 @@ arch_func_t arch_func_arm = {
 	// idbg support
 	arch_arm_get_psr,
 	arch_arm_get_reg,
+	NULL,
+	// flag liveness
 	NULL
 };
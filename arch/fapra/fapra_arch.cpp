@@ -38,6 +38,14 @@ static cpu_register_layout_t arch_fapra_register_layout[] = {
 	{ 0, 32, 0, 0, 0, "R31" },
 };
 
+// the convention of the test programs: argument and result in r3,
+// return address in r0
+static cpu_abi_t arch_fapra_abi = {
+	1, { 3 },
+	3,
+	0
+};
+
 static void
 arch_fapra_init(cpu_t *cpu, cpu_archinfo_t *info, cpu_archrf_t *rf)
 {
@@ -53,6 +61,8 @@ arch_fapra_init(cpu_t *cpu, cpu_archinfo_t *info, cpu_archrf_t *rf)
 	// The address size is 32bits.
 	info->word_size = 32;
 	info->address_size = 32;
+	// Instructions are 32bits wide.
+	info->instr_align = 4;
 	// Page size is 4K or 16M
 	info->min_page_size = 4096;
 	info->max_page_size = 16777216;
@@ -60,6 +70,7 @@ arch_fapra_init(cpu_t *cpu, cpu_archinfo_t *info, cpu_archrf_t *rf)
 	// There are 32 32-bit GPRs 
 	info->regclass_count[CPU_REGCLASS_GPR] = 32;
 	info->register_layout = arch_fapra_register_layout;
+	info->abi = &arch_fapra_abi;
 
 	reg_fapra32_t *reg;
 	reg = (reg_fapra32_t *) malloc(sizeof(reg_fapra32_t));
@@ -115,5 +126,7 @@ arch_func_t arch_func_fapra = {
 	// idbg support
 	arch_fapra_get_psr,
 	arch_fapra_get_reg,
+	NULL,
+	// flag liveness
 	NULL
 };
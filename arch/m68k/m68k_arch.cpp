@@ -40,6 +40,8 @@ arch_m68k_init(cpu_t *cpu, cpu_archinfo_t *info, cpu_archrf_t *rf)
 	info->word_size = 32;
 	info->float_size = 80;
 	info->address_size = 32;
+	// Instructions are 16bit aligned.
+	info->instr_align = 2;
 	// Page size is 4K or 8K, default is 8K.
 	info->min_page_size = 4096;
 	info->max_page_size = 8192;
@@ -94,5 +96,7 @@ arch_func_t arch_func_m68k = {
 	// idbg support
 	arch_m68k_get_psr,
 	arch_m68k_get_reg,
+	NULL,
+	// flag liveness
 	NULL
 };
@@ -79,6 +79,13 @@ static cpu_register_layout_t arch_m88k_register_layout[] = {
 	{ 0, 80, 0, 0, 0, "X31" },
 };
 
+// arguments in r2-r9, result in r2, return address in r1
+static cpu_abi_t arch_m88k_abi = {
+	8, { 2, 3, 4, 5, 6, 7, 8, 9 },
+	2,
+	1
+};
+
 static void
 arch_m88k_init(cpu_t *cpu, cpu_archinfo_t *info, cpu_archrf_t *rf)
 {
@@ -107,6 +114,8 @@ arch_m88k_init(cpu_t *cpu, cpu_archinfo_t *info, cpu_archrf_t *rf)
 	info->word_size = 32;
 	info->float_size = 80;
 	info->address_size = 32;
+	// Instructions are 32bits wide.
+	info->instr_align = 4;
 	// Page size is just 4K.
 	info->min_page_size = 4096;
 	info->max_page_size = 4096;
@@ -118,6 +127,7 @@ arch_m88k_init(cpu_t *cpu, cpu_archinfo_t *info, cpu_archrf_t *rf)
 	// PSR and TRAPNO.
 	info->regclass_count[CPU_REGCLASS_XR] = 2;
 	info->register_layout = arch_m88k_register_layout;
+	info->abi = &arch_m88k_abi;
 
 	// Setup the register files
 	reg = (m88k_grf_t *)malloc(sizeof(m88k_grf_t));
@@ -229,5 +239,7 @@ arch_func_t arch_func_m88k = {
 	// idbg support
 	arch_m88k_get_psr,
 	arch_m88k_get_reg,
-	arch_m88k_get_fp_reg
+	arch_m88k_get_fp_reg,
+	// flag liveness
+	NULL
 };
@@ -252,27 +252,20 @@ arch_m88k_load_fp32(cpu_t *cpu, Value *address, BasicBlock *bb)
 static void
 arch_m88k_store_fp32(cpu_t *cpu, Value *value, Value *address, BasicBlock *bb)
 {
-	arch_store32_aligned(cpu, address, IBITCAST32(FPBITCAST32(value)), bb);
+	arch_store32_aligned(cpu, IBITCAST32(FPBITCAST32(value)), address, bb);
 }
 
+/* doubles only need to be word aligned */
 static Value *
 arch_m88k_load_fp64(cpu_t *cpu, Value *address, BasicBlock *bb)
 {
-	Value *hi = arch_load32_aligned(cpu, address, bb);
-	Value *lo = arch_load32_aligned(cpu, ADD(address, CONST(4)), bb);
-
-	return FPBITCAST80(OR(SHL(ZEXT64(hi), CONST64(32)), ZEXT64(lo)));
+	return FPBITCAST80(arch_load_unaligned(cpu, 64, address, bb));
 }
 
 static void
 arch_m88k_store_fp64(cpu_t *cpu, Value *value, Value *address, BasicBlock *bb)
 {
-	Value *v = IBITCAST64(FPBITCAST64(value));
-	Value *hi = TRUNC32(LSHR(v, CONST64(32)));
-	Value *lo = TRUNC32(v);
-
-	arch_store32_aligned(cpu, address, hi, bb);
-	arch_store32_aligned(cpu, ADD(address, CONST32(4)), lo, bb);
+	arch_store_unaligned(cpu, 64, IBITCAST64(FPBITCAST64(value)), address, bb);
 }
 
 static Value *
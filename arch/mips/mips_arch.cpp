@@ -79,6 +79,13 @@ static cpu_register_layout_t arch_mips_register_layout[] = {
 };
 #endif
 
+// o32: arguments in a0-a3, result in v0, return address in ra
+static cpu_abi_t arch_mips_abi = {
+	4, { 4, 5, 6, 7 },
+	2,
+	31
+};
+
 static void
 arch_mips_init(cpu_t *cpu, cpu_archinfo_t *info, cpu_archrf_t *rf)
 {
@@ -96,6 +103,8 @@ arch_mips_init(cpu_t *cpu, cpu_archinfo_t *info, cpu_archrf_t *rf)
 	// The float size is 64bits.
 	info->byte_size = 8;
 	info->float_size = 80;
+	// Instructions are 32bits wide.
+	info->instr_align = 4;
 	if (info->arch_flags & CPU_MIPS_IS_64BIT) {
   		// The word size is 64bits.
 		// The address size is 64bits.
@@ -116,6 +125,7 @@ arch_mips_init(cpu_t *cpu, cpu_archinfo_t *info, cpu_archrf_t *rf)
 	// There are 2 extra registers, HI/LO for MUL/DIV insn.
 	info->regclass_count[CPU_REGCLASS_XR] = 2;
 	info->register_layout = arch_mips_register_layout;
+	info->abi = &arch_mips_abi;
 
 	if (info->arch_flags & CPU_MIPS_IS_64BIT) {
 		reg_mips64_t *reg;
@@ -187,5 +197,7 @@ arch_func_t arch_func_mips = {
 	// idbg support
 	arch_mips_get_psr,
 	arch_mips_get_reg,
+	NULL,
+	// flag liveness
 	NULL
 };
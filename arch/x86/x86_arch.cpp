@@ -160,5 +160,7 @@ arch_func_t arch_func_x86 = {
 	// idbg support
 	arch_x86_get_psr,
 	arch_x86_get_reg,
+	NULL,
+	// flag liveness
 	NULL
 };
@@ -0,0 +1,251 @@
+/*
+ * libcpu: async.cpp
+ *
+ * Background compilation. The guest thread generates the IR of a
+ * unit and queues it; worker threads optimize and compile it while
+ * the guest keeps running through small single step units. Finished
+ * units are installed by cpu_run on the guest thread, between two
+ * runs of translated code, so JIT code never sees a half installed
+ * unit.
+ */
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <unordered_set>
+
+#include "llvm/IR/Module.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include "libcpu.h"
+#include "async.h"
+#include "cache.h"
+#include "objcache.h"
+#include "optimize.h"
+#include "stat.h"
+
+typedef struct compile_job {
+	cpu_unit_t *unit;
+	LLVMContext *ctx;	/* owned by the job until compiled */
+	Module *mod;
+	Function *func;
+	unsigned level;
+	void *fp;
+	uint64_t compile_usec;
+} compile_job_t;
+
+typedef struct cpu_async {
+	std::mutex lock;
+	std::condition_variable cv_queue;	/* a job was queued, or stop */
+	std::condition_variable cv_done;	/* a job was compiled */
+	std::deque<compile_job_t *> queue;
+	std::deque<compile_job_t *> done;
+	uint32_t in_flight;					/* queued or compiling */
+	bool stop;
+	std::vector<std::thread> workers;
+	std::vector<TargetMachine *> tm;	/* CPU_OPT_LEVELS per worker */
+	std::unordered_set<addr_t> pending;	/* guest thread only */
+} cpu_async_t;
+
+bool
+async_enabled(cpu_t *cpu)
+{
+	/* the object cache compiles on the guest thread */
+	return (cpu->flags_codegen & CPU_CODEGEN_ASYNC) &&
+		!(cpu->flags_debug & (CPU_DEBUG_SINGLESTEP | CPU_DEBUG_SINGLESTEP_BB)) &&
+		!objcache_enabled(cpu);
+}
+
+/*
+ * Target machines are not thread safe; a worker compiles with its own
+ * copies of cpu->tm_level, so that a unit gets the same code here as
+ * on the guest thread, e.g. fast instruction selection at level 0.
+ */
+static TargetMachine *
+copy_target_machine(TargetMachine *tm)
+{
+	TargetMachine *copy = tm->getTarget().createTargetMachine(tm->getTargetTriple().str(),
+		tm->getTargetCPU(), tm->getTargetFeatureString(), tm->Options,
+		tm->getRelocationModel(), tm->getCodeModel(), tm->getOptLevel());
+	assert(copy != NULL);
+	return copy;
+}
+
+static void
+compile_job(cpu_t *cpu, compile_job_t *job, TargetMachine **tm)
+{
+	uint64_t usec = get_wall_usec(cpu);
+	optimize(cpu, job->func, job->level, tm[job->level]);
+
+	job->fp = add_module_object(cpu, job->mod, job->unit->name, tm[job->level]);
+	assert(job->fp != NULL);
+	delete job->mod;
+	delete job->ctx;
+	job->ctx = NULL;
+	job->mod = NULL;
+	job->func = NULL;
+	job->compile_usec = get_wall_usec(cpu) - usec;
+}
+
+static void
+async_worker(cpu_t *cpu, TargetMachine **tm)
+{
+	cpu_async_t *a = cpu->async;
+	std::unique_lock<std::mutex> lock(a->lock);
+
+	for (;;) {
+		a->cv_queue.wait(lock, [a] { return a->stop || !a->queue.empty(); });
+		if (a->stop)
+			return;
+		compile_job_t *job = a->queue.front();
+		a->queue.pop_front();
+
+		lock.unlock();
+		compile_job(cpu, job, tm);
+		lock.lock();
+
+		a->done.push_back(job);
+		a->in_flight--;
+		/* running units leave their loops to pick it up */
+		cpu->code_ready = 1;
+		a->cv_done.notify_all();
+	}
+}
+
+static cpu_async_t *
+async_init(cpu_t *cpu)
+{
+	cpu_async_t *a = new cpu_async_t();
+	assert(a != NULL);
+	a->in_flight = 0;
+	a->stop = false;
+	cpu->async = a;
+
+	uint32_t n = cpu->compile_threads != 0 ? cpu->compile_threads : 1;
+	for (uint32_t i = 0; i < n; i++) {
+		for (unsigned level = 0; level < CPU_OPT_LEVELS; level++)
+			a->tm.push_back(copy_target_machine(cpu->tm_level[level]));
+	}
+	for (uint32_t i = 0; i < n; i++)
+		a->workers.push_back(std::thread(async_worker, cpu, &a->tm[i * CPU_OPT_LEVELS]));
+	return a;
+}
+
+/*
+ * Queue the unit being translated, whose IR in cpu->mod is complete.
+ * Its module and context now belong to the job.
+ */
+void
+async_submit(cpu_t *cpu, cpu_unit_t *unit, Function *func)
+{
+	cpu_async_t *a = cpu->async != NULL ? cpu->async : async_init(cpu);
+
+	compile_job_t *job = new compile_job_t();
+	job->unit = unit;
+	job->ctx = cpu->ctx;
+	job->mod = cpu->mod;
+	job->func = func;
+	job->level = unit->level;
+	job->fp = NULL;
+	job->compile_usec = 0;
+	cpu->ctx = NULL;
+	cpu->mod = NULL;
+	if (cpu->cur_unit == unit)
+		cpu->cur_unit = NULL;
+
+	for (std::vector<addr_t>::const_iterator it = unit->entries.begin(); it != unit->entries.end(); it++)
+		a->pending.insert(*it);
+
+	LOG("unit %s queued\n", unit->name.c_str());
+
+	std::lock_guard<std::mutex> lock(a->lock);
+	a->queue.push_back(job);
+	a->in_flight++;
+	a->cv_queue.notify_one();
+}
+
+/* pc has been translated, but is still being compiled */
+bool
+async_pending(cpu_t *cpu, addr_t pc)
+{
+	return cpu->async != NULL && cpu->async->pending.count(pc) != 0;
+}
+
+/* install the units compiled so far; guest thread only */
+void
+async_install(cpu_t *cpu)
+{
+	cpu_async_t *a = cpu->async;
+	std::deque<compile_job_t *> done;
+
+	if (a == NULL)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(a->lock);
+		done.swap(a->done);
+		cpu->code_ready = 0;
+	}
+
+	for (std::deque<compile_job_t *>::iterator it = done.begin(); it != done.end(); it++) {
+		compile_job_t *job = *it;
+		LOG("unit %s installed\n", job->unit->name.c_str());
+		for (std::vector<addr_t>::const_iterator e = job->unit->entries.begin(); e != job->unit->entries.end(); e++)
+			a->pending.erase(*e);
+		cpu->level_stats.compile_usec[job->level] += job->compile_usec;
+		cache_commit_unit(cpu, job->unit, job->fp);
+		delete job;
+	}
+}
+
+/* wait until all queued units are compiled, and install them */
+void
+async_drain(cpu_t *cpu)
+{
+	cpu_async_t *a = cpu->async;
+
+	if (a == NULL)
+		return;
+
+	{
+		std::unique_lock<std::mutex> lock(a->lock);
+		a->cv_done.wait(lock, [a] { return a->in_flight == 0; });
+	}
+	async_install(cpu);
+}
+
+void
+async_stop(cpu_t *cpu)
+{
+	cpu_async_t *a = cpu->async;
+
+	if (a == NULL)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(a->lock);
+		a->stop = true;
+		a->cv_queue.notify_all();
+	}
+	for (std::vector<std::thread>::iterator it = a->workers.begin(); it != a->workers.end(); it++)
+		it->join();
+	for (std::vector<TargetMachine *>::iterator it = a->tm.begin(); it != a->tm.end(); it++)
+		delete *it;
+
+	/* jobs that never made it into the cache */
+	for (std::deque<compile_job_t *>::iterator it = a->queue.begin(); it != a->queue.end(); it++) {
+		delete (*it)->mod;
+		delete (*it)->ctx;
+		delete (*it)->unit;
+		delete *it;
+	}
+	for (std::deque<compile_job_t *>::iterator it = a->done.begin(); it != a->done.end(); it++) {
+		delete (*it)->unit;
+		delete *it;
+	}
+
+	delete a;
+	cpu->async = NULL;
+}
@@ -0,0 +1,6 @@
+bool async_enabled(cpu_t *cpu);
+void async_submit(cpu_t *cpu, struct cpu_unit *unit, Function *func);
+bool async_pending(cpu_t *cpu, addr_t pc);
+void async_install(cpu_t *cpu);
+void async_drain(cpu_t *cpu);
+void async_stop(cpu_t *cpu);
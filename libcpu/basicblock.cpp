@@ -11,6 +11,8 @@
 #include "libcpu.h"
 #include "libcpu_llvm.h"
 #include "basicblock.h"
+#include "callout.h"
+#include "objcache.h"
 #include "tag.h"
 
 #include <inttypes.h>
@@ -18,15 +20,7 @@
 bool
 is_start_of_basicblock(cpu_t *cpu, addr_t a)
 {
-	tag_t tag = get_tag(cpu, a);
-	return (tag &
-		(TAG_BRANCH_TARGET |	/* someone jumps/branches here */
-		 TAG_SUBROUTINE |		/* someone calls this */
-		 TAG_AFTER_CALL |		/* instruction after a call */
-		 TAG_AFTER_COND |		/* instruction after a branch */
-		 TAG_AFTER_TRAP |		/* instruction after a trap */
-		 TAG_ENTRY))			/* client wants to enter guest code here */
-		&& (tag & TAG_CODE);	/* only if we actually tagged it */
+	return tag_is_bb_start(cpu, a);
 }
 
 void
@@ -43,6 +37,26 @@ emit_store_pc_return(cpu_t *cpu, BasicBlock *bb_branch, addr_t new_pc, BasicBloc
 	BranchInst::Create(bb_ret, bb_branch);
 }
 
+/*
+ * Branch to the function that owns new_pc, if it has already been
+ * compiled; the slot is filled in when that function is translated,
+ * until then we return to cpu_run as usual.
+ */
+void
+emit_chain(cpu_t *cpu, BasicBlock *bb_branch, addr_t new_pc, BasicBlock *bb_ret)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "__libcpu_chain_%llx", (unsigned long long)new_pc);
+	PointerType *type_pfunc = cast<PointerType>(cast<AllocaInst>(cpu->ptr_chain_fp)->getAllocatedType());
+	Constant *v_slot = get_host_ptr(cpu, name, &cpu->chain_slot[new_pc], type_pfunc);
+
+	emit_store_pc(cpu, bb_branch, new_pc);
+	Value *fp = new LoadInst(v_slot, "", false, bb_branch);
+	new StoreInst(fp, cpu->ptr_chain_fp, bb_branch);
+	Value *not_compiled = new ICmpInst(*bb_branch, ICmpInst::ICMP_EQ, fp, ConstantPointerNull::get(type_pfunc));
+	BranchInst::Create(bb_ret, cpu->bb_chain, not_compiled, bb_branch);
+}
+
 BasicBlock *
 create_basicblock(cpu_t *cpu, addr_t addr, Function *f, uint8_t bb_type) {
 	char label[17];
@@ -59,6 +73,13 @@ create_basicblock(cpu_t *cpu, addr_t addr, Function *f, uint8_t bb_type) {
 
 const BasicBlock *
 lookup_basicblock(cpu_t *cpu, Function* f, addr_t pc, BasicBlock *bb_ret, uint8_t bb_type) {
+	// a host function runs in place of the guest code there
+	if (callout_registered(cpu, pc)) {
+		BasicBlock *new_bb = create_basicblock(cpu, pc, cpu->cur_func, BB_TYPE_EXTERNAL);
+		callout_emit(cpu, new_bb, pc);
+		return new_bb;
+	}
+
 	// lookup for the basicblock associated to pc in specified function 'f'
 	bbaddr_map &bb_addr = cpu->func_bb[f];
 	bbaddr_map::const_iterator i = bb_addr.find(pc);
@@ -67,7 +88,72 @@ lookup_basicblock(cpu_t *cpu, Function* f, addr_t pc, BasicBlock *bb_ret, uint8_
 
 	LOG("basic block %c%08" PRIx64 " not found in function %p - creating return basic block!\n", bb_type, pc, f);
 	BasicBlock *new_bb = create_basicblock(cpu, pc, cpu->cur_func, BB_TYPE_EXTERNAL);
-	emit_store_pc_return(cpu, new_bb, pc, bb_ret);
+	if (cpu->bb_chain != NULL)
+		emit_chain(cpu, new_bb, pc, bb_ret);
+	else
+		emit_store_pc_return(cpu, new_bb, pc, bb_ret);
 
 	return new_bb;
 }
+
+/*
+ * Move everything emitted to bb so far into a new block that takes
+ * its place, so that code emitted to bb from now on can be reached
+ * conditionally. bb stays the block the caller keeps emitting to.
+ */
+BasicBlock *
+split_basicblock(cpu_t *cpu, BasicBlock *bb)
+{
+	BasicBlock *head = BasicBlock::Create(_CTX(), "", bb->getParent(), bb);
+	bb->replaceAllUsesWith(head);
+	head->getInstList().splice(head->end(), bb->getInstList());
+
+	// branches to its address that are created later must find the head
+	StringRef name = bb->getName();
+	unsigned long long addr;
+	if (!name.empty() && name[0] == BB_TYPE_NORMAL && !name.drop_front().getAsInteger(16, addr)) {
+		bbaddr_map &bb_addr = cpu->func_bb[bb->getParent()];
+		bbaddr_map::iterator i = bb_addr.find((addr_t)addr);
+		if (i != bb_addr.end() && i->second == bb)
+			i->second = head;
+	}
+	head->takeName(bb);
+
+	if (cpu->bb_split.count(bb) == 0)
+		cpu->bb_split[bb] = head;
+	cpu->bb_inner.insert(head);
+	return head;
+}
+
+/* a block for the control flow between the head of a split and bb */
+BasicBlock *
+create_inner_basicblock(cpu_t *cpu, const char *name, BasicBlock *bb)
+{
+	BasicBlock *inner = BasicBlock::Create(_CTX(), name, bb->getParent(), bb);
+	cpu->bb_inner.insert(inner);
+	return inner;
+}
+
+/*
+ * Branches to a split block created from a pointer taken before it
+ * was split, like a loop back to its own start, must go to its first
+ * head instead. Only the blocks of the splits branch to it legally.
+ */
+void
+fix_split_basicblocks(cpu_t *cpu)
+{
+	for (std::unordered_map<BasicBlock *, BasicBlock *>::iterator it = cpu->bb_split.begin(); it != cpu->bb_split.end(); it++) {
+		BasicBlock *bb = it->first;
+		std::vector<Use *> stale;
+		for (Use &use : bb->uses()) {
+			Instruction *user = dyn_cast<Instruction>(use.getUser());
+			if (user == NULL || !user->isTerminator() || cpu->bb_inner.count(user->getParent()))
+				continue;
+			stale.push_back(&use);
+		}
+		for (std::vector<Use *>::iterator u = stale.begin(); u != stale.end(); u++)
+			(*u)->set(it->second);
+	}
+	cpu->bb_split.clear();
+	cpu->bb_inner.clear();
+}
@@ -2,7 +2,9 @@ enum {
 	BB_TYPE_NORMAL   = 'L', /* basic block for instructions */
 	BB_TYPE_COND     = 'C', /* basic block for "taken" case of cond. execution */
 	BB_TYPE_DELAY    = 'D', /* basic block for delay slot in non-taken case of cond. exec. */
-	BB_TYPE_EXTERNAL = 'E'  /* basic block for unknown addresses; just traps */
+	BB_TYPE_EXTERNAL = 'E', /* basic block for unknown addresses; just traps */
+	BB_TYPE_OSR      = 'O', /* loop header check for newer code */
+	BB_TYPE_STOP     = 'S'  /* loop header check for cpu_request_exit */
 };
 
 bool is_start_of_basicblock(cpu_t *cpu, addr_t a);
@@ -11,3 +13,7 @@ BasicBlock *create_basicblock(cpu_t *cpu, addr_t addr, Function *f, uint8_t bb_t
 const BasicBlock *lookup_basicblock(cpu_t *cpu, Function* f, addr_t pc, BasicBlock *bb_ret, uint8_t bb_type);
 void emit_store_pc(cpu_t *cpu, BasicBlock *bb_branch, addr_t new_pc);
 void emit_store_pc_return(cpu_t *cpu, BasicBlock *bb_branch, addr_t new_pc, BasicBlock *bb_ret);
+void emit_chain(cpu_t *cpu, BasicBlock *bb_branch, addr_t new_pc, BasicBlock *bb_ret);
+BasicBlock *split_basicblock(cpu_t *cpu, BasicBlock *bb);
+BasicBlock *create_inner_basicblock(cpu_t *cpu, const char *name, BasicBlock *bb);
+void fix_split_basicblocks(cpu_t *cpu);
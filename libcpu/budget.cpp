@@ -0,0 +1,60 @@
+/*
+ * libcpu: budget.cpp
+ *
+ * Instruction budget. Code translated with CPU_CODEGEN_BUDGET counts
+ * down the budget by the number of instructions of each basic block
+ * it enters, and returns JIT_RETURN_BUDGET at the start of the first
+ * block it enters with none left, with the pc at that block. The
+ * check is only there in this mode; cpu_run gives it an unlimited
+ * budget, cpu_run_budget a limited one.
+ */
+
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Instructions.h"
+
+#include "libcpu.h"
+#include "libcpu_llvm.h"
+#include "basicblock.h"
+#include "budget.h"
+#include "objcache.h"
+
+bool
+budget_enabled(cpu_t *cpu)
+{
+	/* single stepping returns after every step anyway */
+	return (cpu->flags_codegen & CPU_CODEGEN_BUDGET) &&
+		!(cpu->flags_debug & (CPU_DEBUG_SINGLESTEP | CPU_DEBUG_SINGLESTEP_BB));
+}
+
+/*
+ * Start of the basic block bb at pc: leave if the budget is used up,
+ * otherwise take the block's instructions off it. Their number isn't
+ * known before the block is translated, budget_set_count fills it in.
+ */
+Value *
+budget_emit_check(cpu_t *cpu, BasicBlock *bb, addr_t pc)
+{
+	IntegerType *i64 = getIntegerType(64);
+	Constant *v_budget = get_host_ptr(cpu, "__libcpu_budget", &cpu->budget, i64);
+
+	Value *left = new LoadInst(v_budget, "", false, bb);
+	Value *out = new ICmpInst(*bb, ICmpInst::ICMP_SLE, left, ConstantInt::get(i64, 0));
+
+	// bb: if (out) goto exit; else goto cont;
+	BasicBlock *bb_head = split_basicblock(cpu, bb);
+	BasicBlock *bb_exit = create_inner_basicblock(cpu, "budget", bb);
+	BranchInst::Create(bb_exit, bb, out, bb_head);
+	emit_store_pc_return(cpu, bb_exit, pc, cpu->bb_budget);
+
+	// cont: budget -= instructions
+	Value *v = BinaryOperator::Create(Instruction::Sub, left, ConstantInt::get(i64, 0), "", bb);
+	new StoreInst(v, v_budget, bb);
+	return v;
+}
+
+void
+budget_set_count(cpu_t *cpu, Value *v, uint32_t count)
+{
+	cast<BinaryOperator>(v)->setOperand(1, ConstantInt::get(getIntegerType(64), count));
+}
@@ -0,0 +1,3 @@
+bool budget_enabled(cpu_t *cpu);
+Value *budget_emit_check(cpu_t *cpu, BasicBlock *bb, addr_t pc);
+void budget_set_count(cpu_t *cpu, Value *v, uint32_t count);
@@ -0,0 +1,195 @@
+/*
+ * libcpu: cache.cpp
+ *
+ * Code cache: keeps track of the translated units and which guest
+ * addresses they dispatch, and tells cpu_run when the configured
+ * flush size is exceeded. LLVM 8 has no resource trackers, the code
+ * of a unit is only freed together with the JIT, so there is no
+ * point in dropping single units to make room; cpu_run flushes them
+ * all at once and creates a new JIT, see release_code(). Units whose
+ * entries have all been taken over by newer units are dropped though,
+ * so that they don't count towards the flush size.
+ *
+ * The counters the tier 0 units increment outlive the units: code
+ * that has been dropped from the cache may still be running, or be
+ * chained into, until the JIT is gone.
+ */
+
+#include <inttypes.h>
+#include <algorithm>
+
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+
+#include "libcpu.h"
+#include "libcpu_llvm.h"
+#include "async.h"
+#include "cache.h"
+#include "tag.h"
+
+cpu_unit_t *
+cache_new_unit(cpu_t *cpu)
+{
+	cpu_unit_t *unit = new cpu_unit_t();
+	assert(unit != NULL);
+
+	unit->id = cpu->next_unit_id++;
+	unit->name = std::to_string(unit->id);
+	unit->fp = NULL;
+	unit->size = 0;
+	unit->tier = 1;
+	unit->level = 0;
+	cpu->unit_counters.push_back(0);
+	unit->block_count = &cpu->unit_counters.back();
+	unit->replaces = NULL;
+	unit->tiering = false;
+	unit->osr = false;
+	cpu->cur_unit = unit;
+
+	return unit;
+}
+
+/* the unit being translated dispatches pc, once it is committed */
+void
+cache_add_entry(cpu_t *cpu, addr_t pc)
+{
+	cpu->cur_unit->entries.push_back(pc);
+}
+
+/* free a unit that nobody dispatches to anymore */
+static void
+drop_unit(cpu_t *cpu, cpu_unit_t *unit)
+{
+	/*
+	 * XXX LLVM 8 has no resource trackers, so all we can do is to drop
+	 * the symbol from the JITDylib; the object memory itself stays
+	 * with the linking layer until the JIT is destroyed. The counter
+	 * stays as well, the code may still be running.
+	 */
+	orc::MangleAndInterner mangle(cpu->jit->getExecutionSession(), *cpu->dl);
+	orc::SymbolNameSet names;
+	names.insert(mangle(unit->name));
+	if (auto err = cpu->jit->getMainJITDylib().remove(names)) {
+		LOG("unit %s: cannot remove symbol\n", unit->name.c_str());
+		consumeError(std::move(err));
+	}
+
+	cpu->cache_size -= unit->size;
+	cpu->cache_stats.units--;
+	delete unit;
+}
+
+/* unit has been replaced by newer ones, just free it */
+static void
+retire_unit(cpu_t *cpu, cpu_unit_t *unit)
+{
+	for (size_t i = 0; i < cpu->units.size(); i++) {
+		if (cpu->units[i] != unit)
+			continue;
+		cpu->units.erase(cpu->units.begin() + i);
+		break;
+	}
+	LOG("retiring unit %s\n", unit->name.c_str());
+	drop_unit(cpu, unit);
+}
+
+/* cpu_run should free the code of all units before it goes on */
+bool
+cache_full(cpu_t *cpu)
+{
+	return cpu->cache_flush_size != 0 && cpu->cache_size > cpu->cache_flush_size;
+}
+
+/* some entry of unit is still dispatched to it */
+static bool
+unit_dispatched(cpu_t *cpu, cpu_unit_t *unit)
+{
+	for (std::vector<addr_t>::const_iterator it = unit->entries.begin(); it != unit->entries.end(); it++) {
+		entry_map::const_iterator e = cpu->func_entry.find(*it);
+		if (e != cpu->func_entry.end() && e->second == unit)
+			return true;
+	}
+	return false;
+}
+
+/* unit has been compiled to fp, make its entries available */
+void
+cache_commit_unit(cpu_t *cpu, cpu_unit_t *unit, void *fp)
+{
+	std::vector<cpu_unit_t *> displaced;
+
+	unit->fp = fp;
+
+	/*
+	 * cpu_run finds the entries of this unit from now on, and other
+	 * units chain directly into them.
+	 */
+	for (std::vector<addr_t>::const_iterator it = unit->entries.begin(); it != unit->entries.end(); it++) {
+		cpu_unit_t *&owner = cpu->func_entry[*it];
+		if (owner != NULL && owner != unit->replaces &&
+				std::find(displaced.begin(), displaced.end(), owner) == displaced.end())
+			displaced.push_back(owner);
+		owner = unit;
+		cpu->chain_slot[*it] = fp;
+	}
+
+	cpu->units.push_back(unit);
+	cpu->cache_size += unit->size;
+	cpu->cache_stats.units++;
+	if (unit->replaces != NULL) {
+		retire_unit(cpu, unit->replaces);
+		unit->replaces = NULL;
+	}
+	/*
+	 * e.g. the slow path units of an asynchronously compiled unit;
+	 * units being recompiled are retired by their replacement
+	 */
+	for (std::vector<cpu_unit_t *>::const_iterator it = displaced.begin(); it != displaced.end(); it++) {
+		if (!(*it)->tiering && !unit_dispatched(cpu, *it))
+			retire_unit(cpu, *it);
+	}
+	if (cpu->cur_unit == unit)
+		cpu->cur_unit = NULL;
+}
+
+cpu_unit_t *
+cache_lookup(cpu_t *cpu, addr_t pc)
+{
+	entry_map::const_iterator it = cpu->func_entry.find(pc);
+	if (it == cpu->func_entry.end())
+		return NULL;
+	return it->second;
+}
+
+/* drop all units, their code is translated again when it is reached */
+void
+cache_flush(cpu_t *cpu)
+{
+	for (std::vector<cpu_unit_t *>::iterator it = cpu->units.begin(); it != cpu->units.end(); it++) {
+		cpu_unit_t *unit = *it;
+
+		for (std::vector<addr_t>::const_iterator e = unit->entries.begin(); e != unit->entries.end(); e++) {
+			// other units keep the slot address, just unlink it
+			cpu->chain_slot[*e] = NULL;
+			// unless the unit translated from it is still being compiled
+			if (!async_pending(cpu, *e))
+				clear_tag(cpu, *e, TAG_TRANSLATED);
+		}
+		drop_unit(cpu, unit);
+	}
+	cpu->units.clear();
+
+	cpu->func_bb.clear();
+	cpu->func_entry.clear();
+	cpu->cache_stats.flushes++;
+}
+
+/* free the units and their counters, once none of their code can run anymore */
+void
+cache_free(cpu_t *cpu)
+{
+	for (std::vector<cpu_unit_t *>::iterator it = cpu->units.begin(); it != cpu->units.end(); it++)
+		delete *it;
+	cpu->units.clear();
+	cpu->unit_counters.clear();
+}
@@ -0,0 +1,32 @@
+#ifndef _LIBCPU_CACHE_H_
+#define _LIBCPU_CACHE_H_
+
+#include <string>
+#include <vector>
+
+/* entry point of a unit */
+typedef int (*fp_t)(uint8_t *RAM, void *grf, void *frf, debug_function_t fp);
+
+typedef struct cpu_unit {
+	uint32_t id;
+	std::string name;		/* name of the LLVM function */
+	void *fp;				/* compiled code, NULL while translating */
+	std::vector<addr_t> entries;	/* guest pcs dispatched by this unit */
+	size_t size;			/* guest code bytes translated into this unit */
+	uint32_t tier;			/* 0: quick unoptimized code, 1: full pipeline */
+	uint32_t level;			/* optimization level it is compiled at */
+	uint64_t *block_count;	/* blocks executed, counted in tier 0 only */
+	struct cpu_unit *replaces;	/* tier 0 unit this one is recompiled from */
+	bool tiering;			/* being recompiled */
+	bool osr;				/* newer code may replace it, check on back edges */
+} cpu_unit_t;
+
+cpu_unit_t *cache_new_unit(cpu_t *cpu);
+void cache_add_entry(cpu_t *cpu, addr_t pc);
+void cache_commit_unit(cpu_t *cpu, cpu_unit_t *unit, void *fp);
+cpu_unit_t *cache_lookup(cpu_t *cpu, addr_t pc);
+bool cache_full(cpu_t *cpu);
+void cache_flush(cpu_t *cpu);
+void cache_free(cpu_t *cpu);
+
+#endif
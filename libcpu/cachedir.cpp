@@ -0,0 +1,124 @@
+/*
+ * libcpu: cachedir.cpp
+ *
+ * The directory of the object cache. Cached objects are linked and
+ * run, so the directory and its files must belong to the user. By
+ * default it is $XDG_CACHE_HOME/libcpu or ~/.cache/libcpu, created
+ * with mode 0700; cpu_set_cache_dir picks another one. A directory
+ * that others can get into is not used. Files are created exclusively
+ * and never through a symbolic link, and only read if the user owns
+ * them and nobody else can write them.
+ *
+ * Nothing removes old files: the directory grows with every guest,
+ * set of flags and LLVM version that is run, and can be emptied at
+ * any time.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <string>
+
+#include "libcpu.h"
+#include "cachedir.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW 0
+#endif
+
+static std::string
+cachedir_default()
+{
+	const char *xdg = getenv("XDG_CACHE_HOME");
+
+	/* relative paths are to be ignored */
+	if (xdg != NULL && xdg[0] == '/')
+		return std::string(xdg) + "/libcpu";
+#ifdef _WIN32
+	const char *local = getenv("LOCALAPPDATA");
+	if (local != NULL && local[0] != '\0')
+		return std::string(local) + "\\libcpu";
+#else
+	const char *home = getenv("HOME");
+	if (home != NULL && home[0] != '\0') {
+		std::string cache = std::string(home) + "/.cache";
+		mkdir(cache.c_str(), 0700);
+		return cache + "/libcpu";
+	}
+#endif
+	return "";
+}
+
+/* dir exists or has been created, and only the user can get into it */
+static bool
+cachedir_private(const std::string &dir)
+{
+#ifdef _WIN32
+	return _mkdir(dir.c_str()) == 0 || errno == EEXIST;
+#else
+	struct stat st;
+
+	if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST)
+		return false;
+	if (lstat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+		return false;
+	return st.st_uid == geteuid() && (st.st_mode & 077) == 0;
+#endif
+}
+
+/* the cache directory with a trailing separator, "" if there is no safe one */
+const std::string &
+cachedir_get(cpu_t *cpu)
+{
+	if (!cpu->cache_dir_checked) {
+		std::string dir = cpu->cache_dir.empty() ? cachedir_default() : cpu->cache_dir;
+
+		cpu->cache_dir_checked = true;
+		if (!dir.empty() && cachedir_private(dir))
+			cpu->cache_dir = dir + "/";
+		else {
+			LOG("cache directory \"%s\" is missing or not private, not caching\n", dir.c_str());
+			cpu->cache_dir.clear();
+		}
+	}
+	return cpu->cache_dir;
+}
+
+/* create path for writing, replacing a leftover of ours */
+int
+cachedir_create(cpu_t *cpu, const std::string &path)
+{
+	unlink(path.c_str());
+	return open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_BINARY, 0600);
+}
+
+/* open path for reading, if the user owns it and nobody else can write it */
+int
+cachedir_open(cpu_t *cpu, const std::string &path)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_BINARY);
+
+	if (fd < 0)
+		return -1;
+#ifndef _WIN32
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+			st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+		LOG("%s: not a private file, ignoring it\n", path.c_str());
+		close(fd);
+		return -1;
+	}
+#endif
+	return fd;
+}
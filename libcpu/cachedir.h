@@ -0,0 +1,3 @@
+const std::string &cachedir_get(cpu_t *cpu);
+int cachedir_create(cpu_t *cpu, const std::string &path);
+int cachedir_open(cpu_t *cpu, const std::string &path);
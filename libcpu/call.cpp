@@ -0,0 +1,120 @@
+/*
+ * libcpu: call.cpp
+ *
+ * Calls of guest functions from the host. The architecture's cpu_abi_t
+ * tells which GPRs take the arguments, the result and the return
+ * address. The return address is a sentinel just past the code area:
+ * the guest's return to it leaves the translated code like any jump
+ * out of the code area, so it needs neither a tag nor a unit.
+ *
+ * A function that is in the code cache already is run straight from
+ * its entry; cpu_run only takes over to translate it the first time,
+ * and whenever it leaves its unit before returning.
+ */
+
+#include "libcpu.h"
+#include "cache.h"
+#include "call.h"
+#include "fastmem.h"
+
+static void
+call_init(cpu_t *cpu)
+{
+	cpu_register_layout_t const *layout =
+		&cpu->info.register_layout[cpu->info.regclass_offset[CPU_REGCLASS_GPR]];
+	uint32_t offset = 0;
+
+	/* the register file is packed, see get_struct_reg() */
+	for (size_t n = 0; n < cpu->info.regclass_count[CPU_REGCLASS_GPR]; n++) {
+		cpu->gpr_offset.push_back(offset);
+		offset += (layout[n].bits_size + 7) / 8;
+	}
+}
+
+static uint64_t
+call_get(void *p, uint32_t bits)
+{
+	switch (bits) {
+	case 8: return *(uint8_t *)p;
+	case 16: return *(uint16_t *)p;
+	case 32: return *(uint32_t *)p;
+	default: return *(uint64_t *)p;
+	}
+}
+
+static void
+call_set(void *p, uint32_t bits, uint64_t v)
+{
+	switch (bits) {
+	case 8: *(uint8_t *)p = (uint8_t)v; break;
+	case 16: *(uint16_t *)p = (uint16_t)v; break;
+	case 32: *(uint32_t *)p = (uint32_t)v; break;
+	default: *(uint64_t *)p = v; break;
+	}
+}
+
+static void *
+call_gpr(cpu_t *cpu, uint32_t n, uint32_t *bits)
+{
+	*bits = cpu->info.register_layout[cpu->info.regclass_offset[CPU_REGCLASS_GPR] + n].bits_size;
+	return (uint8_t *)cpu->rf.grf + cpu->gpr_offset[n];
+}
+
+int
+call_run(cpu_t *cpu, addr_t addr, const uint64_t *args, uint32_t nargs, uint64_t *result,
+	debug_function_t debug_function)
+{
+	cpu_abi_t const *abi = cpu->info.abi;
+	uint32_t align = cpu->info.instr_align ? cpu->info.instr_align : 1;
+	uint32_t bits, link_bits, pc_bits = cpu->info.address_size;
+
+	if (abi == NULL || nargs > abi->arg_count) {
+		LOG("cpu_call: %u arguments not supported on %s\n", nargs, cpu->info.name);
+		return -1;
+	}
+	if (cpu->gpr_offset.empty())
+		call_init(cpu);
+
+	addr_t sentinel = (cpu->code_end + align - 1) & ~(addr_t)(align - 1);
+	/* a callout may be calling, it expects its pc and return address back */
+	uint64_t saved_pc = call_get(cpu->rf.pc, pc_bits);
+	void *link = call_gpr(cpu, abi->link_reg, &link_bits);
+	uint64_t saved_link = call_get(link, link_bits);
+
+	for (uint32_t i = 0; i < nargs; i++) {
+		void *arg = call_gpr(cpu, abi->arg_reg[i], &bits);
+		call_set(arg, bits, args[i]);
+	}
+	call_set(link, link_bits, sentinel);
+	call_set(cpu->rf.pc, pc_bits, addr);
+
+	int ret = JIT_RETURN_FUNCNOTFOUND;
+	/* nothing for cpu_run to install or translate first, run the entry */
+	cpu_unit_t *unit = NULL;
+	if (!cpu->tags_dirty && !cpu->tier_hot && !cpu->code_ready)
+		unit = cache_lookup(cpu, addr);
+	if (unit != NULL) {
+		cpu->cache_stats.hits++;
+		fp_t FP = (fp_t)unit->fp;
+		cpu->run_depth++;
+		if (cpu->fastmem != NULL)
+			ret = fastmem_run(cpu, FP, debug_function);
+		else
+			ret = FP(cpu->RAM, cpu->rf.grf, cpu->rf.frf, debug_function);
+		cpu->run_depth--;
+	}
+	if (ret == JIT_RETURN_FUNCNOTFOUND && cpu->f.get_pc(cpu, cpu->rf.grf) != sentinel)
+		ret = cpu_run(cpu, debug_function);
+
+	/* anything else leaves the state for the client to look at */
+	if (cpu->f.get_pc(cpu, cpu->rf.grf) != sentinel)
+		return ret;
+
+	if (result != NULL) {
+		void *res = call_gpr(cpu, abi->result_reg, &bits);
+		*result = call_get(res, bits);
+	}
+	call_set(link, link_bits, saved_link);
+	call_set(cpu->rf.pc, pc_bits, saved_pc);
+	return JIT_RETURN_NOERR;
+}
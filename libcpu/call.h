@@ -0,0 +1,2 @@
+int call_run(cpu_t *cpu, addr_t addr, const uint64_t *args, uint32_t nargs, uint64_t *result,
+	debug_function_t debug_function);
@@ -0,0 +1,70 @@
+/*
+ * libcpu: callout.cpp
+ *
+ * Host functions that run in place of guest code, for high level
+ * emulation of guest OS and library routines. A branch or call to a
+ * registered address is translated into a call of the host function
+ * with the guest registers written back to the register file; the
+ * translated code then returns to cpu_run, which continues at the pc
+ * the host function left without returning to the client. cpu_run
+ * also runs the callouts that indirect branches and returns reach.
+ */
+
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Instructions.h"
+
+#include "libcpu.h"
+#include "libcpu_llvm.h"
+#include "basicblock.h"
+#include "callout.h"
+#include "function.h"
+#include "objcache.h"
+
+void
+callout_register(cpu_t *cpu, addr_t pc, cpu_callout_t fn, void *opaque)
+{
+	if (fn == NULL) {
+		cpu->callouts.erase(pc);
+		return;
+	}
+	cpu->callouts[pc].fn = fn;
+	cpu->callouts[pc].opaque = opaque;
+}
+
+bool
+callout_registered(cpu_t *cpu, addr_t pc)
+{
+	return !cpu->callouts.empty() && cpu->callouts.count(pc) != 0;
+}
+
+/* called by cpu_run and by translated code, with the registers in the register file */
+void
+callout_run(cpu_t *cpu, uint64_t pc)
+{
+	std::map<addr_t, cpu_callout_entry_t>::const_iterator it = cpu->callouts.find((addr_t)pc);
+	if (it != cpu->callouts.end())
+		it->second.fn(cpu, (addr_t)pc, it->second.opaque);
+}
+
+/* bb: pc = addr; spill; callout_run(cpu, addr); return to cpu_run */
+void
+callout_emit(cpu_t *cpu, BasicBlock *bb, addr_t pc)
+{
+	IntegerType *intptr_type = cpu->dl->getIntPtrType(_CTX());
+	std::vector<Type *> types;
+	types.push_back(PointerType::getUnqual(intptr_type));
+	types.push_back(getIntegerType(64));
+	FunctionType *type = FunctionType::get(Type::getVoidTy(_CTX()), types, false);
+
+	emit_store_pc(cpu, bb, pc);
+	cpu_spill_reg_state(cpu, bb);
+	std::vector<Value *> args;
+	args.push_back(get_host_ptr(cpu, "__libcpu_cpu", cpu, intptr_type));
+	args.push_back(ConstantInt::get(getIntegerType(64), pc));
+	CallInst::Create(get_host_func(cpu, "__libcpu_callout", (void *)callout_run, type), args, "", bb);
+	/* the registers are in the register file already, don't spill again */
+	ReturnInst::Create(_CTX(), ConstantInt::get(getIntegerType(32), JIT_RETURN_FUNCNOTFOUND), bb);
+	cpu->bb_callout.insert(bb);
+}
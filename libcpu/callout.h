@@ -0,0 +1,4 @@
+void callout_register(cpu_t *cpu, addr_t pc, cpu_callout_t fn, void *opaque);
+bool callout_registered(cpu_t *cpu, addr_t pc);
+void callout_run(cpu_t *cpu, uint64_t pc);
+void callout_emit(cpu_t *cpu, BasicBlock *bb, addr_t pc);
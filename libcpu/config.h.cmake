@@ -1,5 +1,6 @@
 #cmakedefine HAVE_SYS_RESOURCE_H ${HAVE_SYS_RESOURCE_H}
 #cmakedefine HAVE_GETRUSAGE ${HAVE_GETRUSAGE}
+#cmakedefine HAVE_SYS_MMAN_H ${HAVE_SYS_MMAN_H}
 
 #cmakedefine HAVE_ATTRIBUTE_PACKED ${HAVE_ATTRIBUTE_PACKED}
 #cmakedefine HAVE_PRAGMA_PACK ${HAVE_PRAGMA_PACK}
@@ -0,0 +1,223 @@
+/*
+ * libcpu: fastmem.cpp
+ *
+ * Guest RAM in reserved host address space. cpu_alloc_ram reserves
+ * the whole guest address space plus a guard region, all PROT_NONE,
+ * and only makes the RAM the guest has accessible. Translated code
+ * keeps indexing RAM without any checks; an access outside the RAM
+ * faults, and the fault handler leaves the translated code with
+ * JIT_RETURN_MEMFAULT instead of corrupting host memory.
+ *
+ * Translated code doesn't keep the guest pc up to date, so in this
+ * mode every basic block stores its address to fault_pc when it is
+ * entered, and writes the guest registers back to the register file.
+ * After a fault, the registers are those of the start of the block at
+ * fault_pc. Guest memory is not rolled back: the stores the block
+ * made before the fault are repeated if it is run again.
+ */
+
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Instructions.h"
+
+#include "libcpu.h"
+#include "libcpu_llvm.h"
+#include "cache.h"
+#include "fastmem.h"
+#include "function.h"
+#include "objcache.h"
+#if HAVE_SYS_MMAN_H
+#include <signal.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+/* past the end of the address space, for accesses that wrap */
+#define FASTMEM_GUARD (64 * 1024)
+
+#if HAVE_SYS_MMAN_H
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+typedef struct cpu_fastmem {
+	uint8_t *base;
+	size_t reserved;	/* address space plus guard */
+	size_t size;		/* accessible RAM at base */
+	volatile bool running;	/* translated code is running */
+	sigjmp_buf *env;	/* of the innermost fastmem_run */
+} cpu_fastmem_t;
+
+/* the cpu whose translated code runs on this thread */
+static thread_local cpu_t *fastmem_cpu;
+
+static bool fastmem_installed;
+static struct sigaction old_segv, old_bus;
+
+static void
+fastmem_handler(int sig, siginfo_t *info, void *context)
+{
+	cpu_t *cpu = fastmem_cpu;
+	if (cpu != NULL && cpu->fastmem->running) {
+		cpu_fastmem_t *fm = cpu->fastmem;
+		uint8_t *addr = (uint8_t *)info->si_addr;
+		if (addr >= fm->base && addr < fm->base + fm->reserved) {
+			cpu->fault_addr = addr - fm->base;
+			fm->running = false;
+			siglongjmp(*fm->env, 1);
+		}
+	}
+
+	/* not a guest access, hand it to whoever had it before */
+	struct sigaction *old = sig == SIGBUS ? &old_bus : &old_segv;
+	if (old->sa_flags & SA_SIGINFO)
+		old->sa_sigaction(sig, info, context);
+	else if (old->sa_handler != SIG_DFL && old->sa_handler != SIG_IGN)
+		old->sa_handler(sig);
+	else
+		signal(sig, SIG_DFL); /* the access faults again, and kills us */
+}
+
+static void
+fastmem_install(void)
+{
+	struct sigaction sa;
+
+	if (fastmem_installed)
+		return;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = fastmem_handler;
+	sa.sa_flags = SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGSEGV, &sa, &old_segv);
+	sigaction(SIGBUS, &sa, &old_bus);
+	fastmem_installed = true;
+}
+
+/*
+ * Reserve the guest address space and make the first size bytes of
+ * it accessible RAM. Only guests with up to 32 bit addresses on 64
+ * bit hosts are supported.
+ */
+uint8_t *
+fastmem_alloc(cpu_t *cpu, size_t size)
+{
+	if (cpu->fastmem != NULL)
+		fastmem_free(cpu);
+	if (sizeof(void *) < 8 || cpu->info.address_size > 32) {
+		LOG("fastmem: %u bit guest addresses don't fit\n", cpu->info.address_size);
+		return NULL;
+	}
+
+	size_t span = (size_t)1 << cpu->info.address_size;
+	size_t page = sysconf(_SC_PAGESIZE);
+	if (size > span)
+		size = span;
+	size = (size + page - 1) & ~(page - 1);
+
+	void *p = mmap(NULL, span + FASTMEM_GUARD, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED) {
+		LOG("fastmem: cannot reserve %zu bytes\n", span + FASTMEM_GUARD);
+		return NULL;
+	}
+	if (size != 0 && mprotect(p, size, PROT_READ | PROT_WRITE) != 0) {
+		LOG("fastmem: cannot commit %zu bytes\n", size);
+		munmap(p, span + FASTMEM_GUARD);
+		return NULL;
+	}
+
+	fastmem_install();
+	cpu_fastmem_t *fm = new cpu_fastmem_t;
+	fm->base = (uint8_t *)p;
+	fm->reserved = span + FASTMEM_GUARD;
+	fm->size = size;
+	fm->running = false;
+	fm->env = NULL;
+	cpu->fastmem = fm;
+	return fm->base;
+}
+
+void
+fastmem_free(cpu_t *cpu)
+{
+	cpu_fastmem_t *fm = cpu->fastmem;
+	if (fm == NULL)
+		return;
+	if (cpu->RAM == fm->base)
+		cpu->RAM = NULL;
+	munmap(fm->base, fm->reserved);
+	delete fm;
+	cpu->fastmem = NULL;
+}
+
+/*
+ * Run translated code, turning faults on guest RAM into
+ * JIT_RETURN_MEMFAULT. Runs nest when a callout calls cpu_call; the
+ * outer run gets its jump buffer and running flag back afterwards.
+ */
+int
+fastmem_run(cpu_t *cpu, fp_t fp, debug_function_t debug_function)
+{
+	cpu_fastmem_t *fm = cpu->fastmem;
+	cpu_t *outer = fastmem_cpu;
+	sigjmp_buf env;
+	sigjmp_buf *outer_env = fm->env;
+	bool outer_running = fm->running;
+	int ret;
+
+	fastmem_cpu = cpu;
+	fm->env = &env;
+	fm->running = true;
+	if (sigsetjmp(env, 1) == 0)
+		ret = fp(cpu->RAM, cpu->rf.grf, cpu->rf.frf, debug_function);
+	else {
+		/* single step code left the pc at the faulting instruction */
+		if (cpu->flags_debug & (CPU_DEBUG_SINGLESTEP | CPU_DEBUG_SINGLESTEP_BB))
+			cpu->fault_pc = cpu->f.get_pc(cpu, cpu->rf.grf);
+		ret = JIT_RETURN_MEMFAULT;
+	}
+	fm->running = outer_running;
+	fm->env = outer_env;
+	fastmem_cpu = outer;
+	return ret;
+}
+
+#else /* !HAVE_SYS_MMAN_H */
+
+uint8_t *
+fastmem_alloc(cpu_t *cpu, size_t size)
+{
+	LOG("fastmem: not supported on this host\n");
+	return NULL;
+}
+
+void
+fastmem_free(cpu_t *cpu)
+{
+}
+
+int
+fastmem_run(cpu_t *cpu, fp_t fp, debug_function_t debug_function)
+{
+	return fp(cpu->RAM, cpu->rf.grf, cpu->rf.frf, debug_function);
+}
+
+#endif
+
+/*
+ * Remember the basic block at pc as the one a fault happens in, and
+ * the registers it starts with, so that the guest can go on from there.
+ */
+void
+fastmem_emit_pc(cpu_t *cpu, BasicBlock *bb, addr_t pc)
+{
+	Constant *v_pc = get_host_ptr(cpu, "__libcpu_fault_pc", &cpu->fault_pc, getIntegerType(64));
+	new StoreInst(ConstantInt::get(getIntegerType(64), pc), v_pc, bb);
+	cpu_spill_reg_state(cpu, bb);
+}
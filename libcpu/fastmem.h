@@ -0,0 +1,4 @@
+uint8_t *fastmem_alloc(cpu_t *cpu, size_t size);
+void fastmem_free(cpu_t *cpu);
+int fastmem_run(cpu_t *cpu, fp_t fp, debug_function_t debug_function);
+void fastmem_emit_pc(cpu_t *cpu, BasicBlock *bb, addr_t pc);
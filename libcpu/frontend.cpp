@@ -7,7 +7,9 @@
  */
 
 #include <assert.h>
+#include <inttypes.h>
 
+#include "llvm/Analysis/ConstantFolding.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/IRBuilder.h"
@@ -18,6 +20,10 @@
 #include "libcpu.h"
 #include "libcpu_llvm.h"
 #include "frontend.h"
+#include "objcache.h"
+#include "softmmu.h"
+#include "region.h"
+#include "basicblock.h"
 
 //////////////////////////////////////////////////////////////////////
 // GENERIC: register access
@@ -182,84 +188,259 @@ RAM32LE(uint8_t *RAM, addr_t a) {
 // GENERIC: memory access
 //////////////////////////////////////////////////////////////////////
 
-/* get a RAM pointer to a 32 bit value */
+/* the RAM index of a guest address: translated by the soft MMU, unsigned */
 static Value *
-arch_gep32(cpu_t *cpu, Value *a, BasicBlock *bb) {
+arch_address(cpu_t *cpu, Value *a, bool write, BasicBlock *bb) {
+	if (cpu->tlb != NULL)
+		return softmmu_translate(cpu, a, write, bb);
+	/* guest addresses are unsigned, the GEP would sign extend them */
+	if (a->getType()->getIntegerBitWidth() < cpu->dl->getPointerSizeInBits())
+		a = new ZExtInst(a, cpu->dl->getIntPtrType(_CTX()), "", bb);
+	return a;
+}
+
+/* get a RAM pointer to a value of the given width */
+static Value *
+arch_gep(cpu_t *cpu, Value *a, uint32_t bits, BasicBlock *bb) {
 	a = GetElementPtrInst::CreateInBounds(cpu->ptr_RAM, a, "", bb);
-	return new BitCastInst(a, PointerType::get(XgetType(Int32Ty), 0), "", bb);
+	if (bits == 8)
+		return a;
+	return new BitCastInst(a, PointerType::get(getIntegerType(bits), 0), "", bb);
+}
+
+/* truncate or zero extend a value to the given width */
+static Value *
+arch_adjust_width(cpu_t *cpu, Value *v, uint32_t bits, BasicBlock *bb) {
+	uint32_t width = v->getType()->getIntegerBitWidth();
+	if (width > bits)
+		return TRUNC(bits, v);
+	if (width < bits)
+		return ZEXT(bits, v);
+	return v;
+}
+
+/* load from RAM at index a, swapped into host byte order */
+static Value *
+arch_load_ram(cpu_t *cpu, uint32_t bits, unsigned align, Value *a, BasicBlock *bb) {
+	Value *v = new LoadInst(arch_gep(cpu, a, bits, bb), "", false, align, bb);
+	if (bits > 8 && (cpu->flags & CPU_FLAG_SWAPMEM))
+		v = arch_bswap(cpu, bits, v, bb);
+	return v;
+}
+
+/* store to RAM at index a, swapped into guest byte order */
+static void
+arch_store_ram(cpu_t *cpu, uint32_t bits, unsigned align, Value *v, Value *a, BasicBlock *bb) {
+	if (bits > 8 && (cpu->flags & CPU_FLAG_SWAPMEM))
+		v = arch_bswap(cpu, bits, v, bb);
+	new StoreInst(v, arch_gep(cpu, a, bits, bb), false, align, bb);
+}
+
+//////////////////////////////////////////////////////////////////////
+// GENERIC: memory regions
+//////////////////////////////////////////////////////////////////////
+
+/* the value of an address computed from constants only, or NULL */
+static ConstantInt *
+arch_const_address(cpu_t *cpu, Value *a, unsigned depth = 0) {
+	if (ConstantInt *c = dyn_cast<ConstantInt>(a))
+		return c;
+	Instruction *i = dyn_cast<Instruction>(a);
+	if (i == NULL || depth > 4 || !(isa<BinaryOperator>(i) || isa<CastInst>(i)))
+		return NULL;
+	SmallVector<Constant *, 2> ops;
+	for (unsigned n = 0; n < i->getNumOperands(); n++) {
+		ConstantInt *c = arch_const_address(cpu, i->getOperand(n), depth + 1);
+		if (c == NULL)
+			return NULL;
+		ops.push_back(c);
+	}
+	return dyn_cast_or_null<ConstantInt>(ConstantFoldInstOperands(i, ops, *cpu->dl));
+}
+
+/* true if a is in one of the regions of the given kinds */
+static Value *
+arch_region_check(cpu_t *cpu, Value *a, uint32_t kinds, BasicBlock *bb) {
+	Type *type = a->getType();
+	Value *in = NULL;
+
+	for (size_t i = 0; i < cpu->regions.size(); i++) {
+		cpu_region_t *r = &cpu->regions[i];
+		if (!(kinds & (1 << r->kind)))
+			continue;
+		Value *offset = BinaryOperator::Create(Instruction::Sub, a, ConstantInt::get(type, r->start), "", bb);
+		Value *hit = new ICmpInst(*bb, ICmpInst::ICMP_ULT, offset, ConstantInt::get(type, r->len));
+		in = in != NULL ? BinaryOperator::Create(Instruction::Or, in, hit, "", bb) : hit;
+	}
+	return in;
+}
+
+/* call region_read, the region is looked up at run time if it is -1 */
+static Value *
+arch_region_read(cpu_t *cpu, int region, Value *a, uint32_t bits, BasicBlock *bb) {
+	IntegerType *intptr_type = cpu->dl->getIntPtrType(_CTX());
+	std::vector<Type *> types;
+	types.push_back(PointerType::getUnqual(intptr_type));
+	types.push_back(getIntegerType(64));
+	types.push_back(getIntegerType(32));
+	types.push_back(getIntegerType(32));
+	FunctionType *type = FunctionType::get(getIntegerType(64), types, false);
+
+	std::vector<Value *> args;
+	args.push_back(get_host_ptr(cpu, "__libcpu_cpu", cpu, intptr_type));
+	args.push_back(arch_adjust_width(cpu, a, 64, bb));
+	args.push_back(ConstantInt::get(getIntegerType(32), bits));
+	args.push_back(ConstantInt::get(getIntegerType(32), region));
+	Value *v = CallInst::Create(get_host_func(cpu, "__libcpu_region_read", (void *)region_read, type), args, "", bb);
+	return arch_adjust_width(cpu, v, bits, bb);
+}
+
+static void
+arch_region_write(cpu_t *cpu, int region, Value *a, uint32_t bits, Value *v, BasicBlock *bb) {
+	IntegerType *intptr_type = cpu->dl->getIntPtrType(_CTX());
+	std::vector<Type *> types;
+	types.push_back(PointerType::getUnqual(intptr_type));
+	types.push_back(getIntegerType(64));
+	types.push_back(getIntegerType(32));
+	types.push_back(getIntegerType(64));
+	types.push_back(getIntegerType(32));
+	FunctionType *type = FunctionType::get(Type::getVoidTy(_CTX()), types, false);
+
+	std::vector<Value *> args;
+	args.push_back(get_host_ptr(cpu, "__libcpu_cpu", cpu, intptr_type));
+	args.push_back(arch_adjust_width(cpu, a, 64, bb));
+	args.push_back(ConstantInt::get(getIntegerType(32), bits));
+	args.push_back(arch_adjust_width(cpu, v, 64, bb));
+	args.push_back(ConstantInt::get(getIntegerType(32), region));
+	CallInst::Create(get_host_func(cpu, "__libcpu_region_write", (void *)region_write, type), args, "", bb);
+}
+
+/* load a value of the given width, swapped into host byte order */
+static Value *
+arch_load_mem(cpu_t *cpu, uint32_t bits, unsigned align, Value *a, BasicBlock *bb) {
+	a = arch_address(cpu, a, false, bb);
+	if (cpu->regions.empty())
+		return arch_load_ram(cpu, bits, align, a, bb);
+
+	/* the region is known at translation time */
+	ConstantInt *c = arch_const_address(cpu, a);
+	if (c != NULL) {
+		int region = region_find(cpu, c->getZExtValue(), bits / 8);
+		if (region < 0)
+			return arch_load_ram(cpu, bits, align, a, bb);
+		if (cpu->regions[region].kind == CPU_REGION_ROM)
+			return ConstantInt::get(getIntegerType(bits), region_rom_value(cpu, c->getZExtValue(), bits));
+		return arch_region_read(cpu, region, a, bits, bb);
+	}
+	if (!region_any(cpu, 1 << CPU_REGION_MMIO))
+		return arch_load_ram(cpu, bits, align, a, bb);
+
+	// bb: if (mmio) goto io; else goto ram;
+	Value *io = arch_region_check(cpu, a, 1 << CPU_REGION_MMIO, bb);
+	BasicBlock *bb_head = split_basicblock(cpu, bb);
+	BasicBlock *bb_io = create_inner_basicblock(cpu, "mmio", bb);
+	BasicBlock *bb_ram = create_inner_basicblock(cpu, "ram", bb);
+	BranchInst::Create(bb_io, bb_ram, io, bb_head);
+	Value *v_io = arch_region_read(cpu, -1, a, bits, bb_io);
+	BranchInst::Create(bb, bb_io);
+	Value *v_ram = arch_load_ram(cpu, bits, align, a, bb_ram);
+	BranchInst::Create(bb, bb_ram);
+
+	PHINode *phi = PHINode::Create(getIntegerType(bits), 2, "", bb);
+	phi->addIncoming(v_io, bb_io);
+	phi->addIncoming(v_ram, bb_ram);
+	return phi;
+}
+
+/* store a value of the given width, swapped into guest byte order */
+static void
+arch_store_mem(cpu_t *cpu, uint32_t bits, unsigned align, Value *v, Value *a, BasicBlock *bb) {
+	a = arch_address(cpu, a, true, bb);
+	v = arch_adjust_width(cpu, v, bits, bb);
+	if (cpu->regions.empty()) {
+		arch_store_ram(cpu, bits, align, v, a, bb);
+		return;
+	}
+
+	/* the region is known at translation time */
+	ConstantInt *c = arch_const_address(cpu, a);
+	if (c != NULL) {
+		int region = region_find(cpu, c->getZExtValue(), bits / 8);
+		if (region < 0)
+			arch_store_ram(cpu, bits, align, v, a, bb);
+		else if (cpu->regions[region].kind == CPU_REGION_MMIO)
+			arch_region_write(cpu, region, a, bits, v, bb);
+		else
+			LOG("store to ROM at %" PRIx64 " dropped\n", (uint64_t)c->getZExtValue());
+		return;
+	}
+
+	// bb: if (rom or mmio) goto io; else goto ram;
+	Value *io = arch_region_check(cpu, a, (1 << CPU_REGION_ROM) | (1 << CPU_REGION_MMIO), bb);
+	BasicBlock *bb_head = split_basicblock(cpu, bb);
+	BasicBlock *bb_io = create_inner_basicblock(cpu, "mmio", bb);
+	BasicBlock *bb_ram = create_inner_basicblock(cpu, "ram", bb);
+	BranchInst::Create(bb_io, bb_ram, io, bb_head);
+	arch_region_write(cpu, -1, a, bits, v, bb_io);
+	BranchInst::Create(bb, bb_io);
+	arch_store_ram(cpu, bits, align, v, a, bb_ram);
+	BranchInst::Create(bb, bb_ram);
 }
 
 /* load 32 bit ALIGNED value from RAM */
 Value *
 arch_load32_aligned(cpu_t *cpu, Value *a, BasicBlock *bb) {
-	a = arch_gep32(cpu, a, bb);
-	if (cpu->flags & CPU_FLAG_SWAPMEM)
-		return SWAP32(new LoadInst(a, "", false, bb));
-	else
-		return new LoadInst(a, "", false, bb);
+	return arch_load_mem(cpu, 32, 4, a, bb);
 }
 
 /* store 32 bit ALIGNED value to RAM */
 void
 arch_store32_aligned(cpu_t *cpu, Value *v, Value *a, BasicBlock *bb) {
-	a = arch_gep32(cpu, a, bb);
-	new StoreInst((cpu->flags & CPU_FLAG_SWAPMEM) ? SWAP32(v) : v, a, bb);
+	arch_store_mem(cpu, 32, 4, v, a, bb);
 }
 
-//////////////////////////////////////////////////////////////////////
-// GENERIC: endianness
-//////////////////////////////////////////////////////////////////////
+/* load 64 bit ALIGNED value from RAM */
+Value *
+arch_load64_aligned(cpu_t *cpu, Value *a, BasicBlock *bb) {
+	return arch_load_mem(cpu, 64, 8, a, bb);
+}
 
-static Value *
-arch_get_shift8(cpu_t *cpu, Value *addr, BasicBlock *bb)
-{
-	Value *shift = AND(addr,CONST(3));
-	if (!IS_LITTLE_ENDIAN(cpu))
-		shift = XOR(shift, CONST(3));
-	return SHL(shift, CONST(3));
+/* store 64 bit ALIGNED value to RAM */
+void
+arch_store64_aligned(cpu_t *cpu, Value *v, Value *a, BasicBlock *bb) {
+	arch_store_mem(cpu, 64, 8, v, a, bb);
 }
 
-static Value *
-arch_get_shift16(cpu_t *cpu, Value *addr, BasicBlock *bb)
-{
-	Value *shift = AND(LSHR(addr,CONST(1)),CONST(1));
-	if (!IS_LITTLE_ENDIAN(cpu))
-		shift = XOR(shift, CONST(1));
-	return SHL(shift, CONST(4));
+/* load 16, 32 or 64 bit value from RAM at any address */
+Value *
+arch_load_unaligned(cpu_t *cpu, uint32_t bits, Value *a, BasicBlock *bb) {
+	return arch_load_mem(cpu, bits, 1, a, bb);
+}
+
+/* store 16, 32 or 64 bit value to RAM at any address */
+void
+arch_store_unaligned(cpu_t *cpu, uint32_t bits, Value *v, Value *a, BasicBlock *bb) {
+	arch_store_mem(cpu, bits, 1, v, a, bb);
 }
 
 Value *
 arch_load8(cpu_t *cpu, Value *addr, BasicBlock *bb) {
-	Value *shift = arch_get_shift8(cpu, addr, bb);
-	Value *val = arch_load32_aligned(cpu, AND(addr, CONST(~3ULL)), bb);
-	return TRUNC8(LSHR(val, shift));
+	return arch_load_mem(cpu, 8, 1, addr, bb);
 }
 
 Value *
 arch_load16_aligned(cpu_t *cpu, Value *addr, BasicBlock *bb) {
-	Value *shift = arch_get_shift16(cpu, addr, bb);
-	Value *val = arch_load32_aligned(cpu, AND(addr, CONST(~3ULL)), bb);
-	return TRUNC16(LSHR(val, shift));
+	return arch_load_mem(cpu, 16, 2, addr, bb);
 }
 
 void
 arch_store8(cpu_t *cpu, Value *val, Value *addr, BasicBlock *bb) {
-	Value *shift = arch_get_shift8(cpu, addr, bb);
-	addr = AND(addr, CONST(~3ULL));
-	Value *mask = XOR(SHL(CONST(255), shift),CONST(-1ULL));
-	Value *old = AND(arch_load32_aligned(cpu, addr, bb), mask);
-	val = OR(old, SHL(AND(val, CONST(255)), shift));
-	arch_store32_aligned(cpu, val, addr, bb);
+	arch_store_mem(cpu, 8, 1, val, addr, bb);
 }
 
 void
 arch_store16(cpu_t *cpu, Value *val, Value *addr, BasicBlock *bb) {
-	Value *shift = arch_get_shift16(cpu, addr, bb);
-	addr = AND(addr, CONST(~3ULL));
-	Value *mask = XOR(SHL(CONST(65535), shift),CONST(-1ULL));
-	Value *old = AND(arch_load32_aligned(cpu, addr, bb), mask);
-	val = OR(old, SHL(AND(val, CONST(65535)), shift));
-	arch_store32_aligned(cpu, val, addr, bb);
+	arch_store_mem(cpu, 16, 2, val, addr, bb);
 }
 
 //
@@ -277,21 +458,21 @@ Value *
 arch_bswap(cpu_t *cpu, size_t width, Value *v, BasicBlock *bb) {
 	std::vector<Type *> arg_type;
 	arg_type.push_back(getIntegerType(width));
-	return CallInst::Create(Intrinsic::getDeclaration(cpu->mod[cpu->functions], Intrinsic::bswap, arg_type), v, "", bb);
+	return CallInst::Create(Intrinsic::getDeclaration(cpu->mod, Intrinsic::bswap, arg_type), v, "", bb);
 }
 
 Value *
 arch_ctlz(cpu_t *cpu, size_t width, Value *v, BasicBlock *bb) {
 	std::vector<Type *> arg_type;
 	arg_type.push_back(getIntegerType(width));
-	return CallInst::Create(Intrinsic::getDeclaration(cpu->mod[cpu->functions], Intrinsic::ctlz, arg_type), v, "", bb);
+	return CallInst::Create(Intrinsic::getDeclaration(cpu->mod, Intrinsic::ctlz, arg_type), v, "", bb);
 }
 
 Value *
 arch_cttz(cpu_t *cpu, size_t width, Value *v, BasicBlock *bb) {
 	std::vector<Type *> arg_type;
 	arg_type.push_back(getIntegerType(width));
-	return CallInst::Create(Intrinsic::getDeclaration(cpu->mod[cpu->functions], Intrinsic::cttz, arg_type), v, "", bb);
+	return CallInst::Create(Intrinsic::getDeclaration(cpu->mod, Intrinsic::cttz, arg_type), v, "", bb);
 }
 
 // complex operations
@@ -315,7 +496,8 @@ arch_shiftrotate(cpu_t *cpu, Value *dst, Value *src, bool left, bool rotate, Bas
 			v = OR(v,SHL(ZEXT(SIZE(v), LOAD(cpu->ptr_C)), CONSTs(SIZE(v), SIZE(v)-1)));
 	}
 	
-	LET1(cpu->ptr_C, c);
+	if (!arch_flag_dead(cpu, CPU_FLAGTYPE_CARRY))
+		LET1(cpu->ptr_C, c);
 	return STORE(v, dst);
 }
 
@@ -336,7 +518,8 @@ arch_adc(cpu_t *cpu, Value *dst, Value *src, Value *v, bool plus_carry, bool plu
 		Value *v1 = ADD(ADD(ZEXT16(LOAD(src)), ZEXT16(v)), ZEXT16(c));
 
 		/* get C */
-		STORE(TRUNC1(LSHR(v1, CONST16(8))), cpu->ptr_C);
+		if (!arch_flag_dead(cpu, CPU_FLAGTYPE_CARRY))
+			STORE(TRUNC1(LSHR(v1, CONST16(8))), cpu->ptr_C);
 
 		/* get result */
 		v1 = TRUNC8(v1);
@@ -399,6 +582,45 @@ arch_decode_bit(cpu_t *cpu, Value *flags, Value *bit, int shift, int width, Basi
 	new StoreInst(n, bit, bb);
 }
 
+/* the instruction's write to the flag of this type is never read */
+bool
+arch_flag_dead(cpu_t *cpu, char type)
+{
+	cpu_flags_layout_t const *flags_layout = cpu->info.flags_layout;
+
+	if (cpu->cur_flags_dead == 0)
+		return false;
+	for (size_t i = 0; i < cpu->info.flags_count; i++) {
+		if (flags_layout[i].type == type)
+			return (cpu->cur_flags_dead >> flags_layout[i].shift) & 1;
+	}
+	return false;
+}
+
+// N and Z, unless the instruction's setting of them is dead
+
+void
+arch_set_N(cpu_t *cpu, Value *n, BasicBlock *bb)
+{
+	if (!arch_flag_dead(cpu, CPU_FLAGTYPE_NEGATIVE))
+		LET1(cpu->ptr_N, n);
+}
+
+void
+arch_set_Z(cpu_t *cpu, Value *z, BasicBlock *bb)
+{
+	if (!arch_flag_dead(cpu, CPU_FLAGTYPE_ZERO))
+		LET1(cpu->ptr_Z, z);
+}
+
+/* set N and Z from the result v */
+void
+arch_set_NZ(cpu_t *cpu, Value *v, BasicBlock *bb)
+{
+	arch_set_N(cpu, ICMP_SLT(v, CONSTs(SIZE(v), 0)), bb);
+	arch_set_Z(cpu, ICMP_EQ(v, CONSTs(SIZE(v), 0)), bb);
+}
+
 // flags encoding and decoding
 
 Value *
@@ -432,7 +654,7 @@ Value *
 arch_sqrt(cpu_t *cpu, size_t width, Value *v, BasicBlock *bb) {
 	std::vector<Type *> arg_type;
 	arg_type.push_back(getFloatType(width));
-	return CallInst::Create(Intrinsic::getDeclaration(cpu->mod[cpu->functions], Intrinsic::sqrt, arg_type), v, "", bb);
+	return CallInst::Create(Intrinsic::getDeclaration(cpu->mod, Intrinsic::sqrt, arg_type), v, "", bb);
 }
 
 // Invoke debug_function
@@ -445,8 +667,7 @@ arch_debug_me(cpu_t *cpu, BasicBlock *bb)
 
 	//IntegerType *intptr_type = cpu->jit->get_exec_engine()->getDataLayout().getIntPtrType(_CTX());
 	IntegerType *intptr_type = cpu->dl->getIntPtrType(_CTX());
-	Constant *v_cpu = ConstantInt::get(intptr_type, (uintptr_t)cpu);
-	Value *v_cpu_ptr = ConstantExpr::getIntToPtr(v_cpu, PointerType::getUnqual(intptr_type));
+	Value *v_cpu_ptr = get_host_ptr(cpu, "__libcpu_cpu", cpu, intptr_type);
 
 	// XXX synchronize cpu context!
 	CallInst::Create(cpu->ptr_func_debug, v_cpu_ptr, "", bb);
@@ -9,6 +9,10 @@ Value *arch_load8(cpu_t *cpu, Value *addr, BasicBlock *bb);
 Value *arch_load16_aligned(cpu_t *cpu, Value *addr, BasicBlock *bb);
 void arch_store8(cpu_t *cpu, Value *val, Value *addr, BasicBlock *bb);
 void arch_store16(cpu_t *cpu, Value *val, Value *addr, BasicBlock *bb);
+Value *arch_load64_aligned(cpu_t *cpu, Value *a, BasicBlock *bb);
+void arch_store64_aligned(cpu_t *cpu, Value *v, Value *a, BasicBlock *bb);
+Value *arch_load_unaligned(cpu_t *cpu, uint32_t bits, Value *a, BasicBlock *bb);
+void arch_store_unaligned(cpu_t *cpu, uint32_t bits, Value *v, Value *a, BasicBlock *bb);
 
 Value *arch_store(Value *v, Value *a, BasicBlock *bb);
 
@@ -20,6 +24,10 @@ void arch_decode_bit(cpu_t *cpu, Value *flags, Value *bit, int shift, int width,
 
 Value *arch_flags_encode(cpu_t *cpu, BasicBlock *bb);
 void arch_flags_decode(cpu_t *cpu, Value *flags, BasicBlock *bb);
+bool arch_flag_dead(cpu_t *cpu, char type);
+void arch_set_N(cpu_t *cpu, Value *n, BasicBlock *bb);
+void arch_set_Z(cpu_t *cpu, Value *z, BasicBlock *bb);
+void arch_set_NZ(cpu_t *cpu, Value *v, BasicBlock *bb);
 
 Value *arch_bswap(cpu_t *cpu, size_t width, Value *v, BasicBlock *bb);
 Value *arch_ctlz(cpu_t *cpu, size_t width, Value *v, BasicBlock *bb);
@@ -195,13 +203,24 @@ uint32_t RAM32LE(uint8_t *RAM, addr_t a);
 #define LOAD16(i,v) arch_put_reg(cpu, i, arch_load16_aligned(cpu,v,bb), 16, false, bb)
 #define LOAD16S(i,v) arch_put_reg(cpu, i, arch_load16_aligned(cpu,v,bb), 16, true, bb)
 #define LOAD32(i,v) arch_put_reg(cpu, i, arch_load32_aligned(cpu,v,bb), 32, true, bb)
+#define LOAD64(i,v) arch_put_reg(cpu, i, arch_load64_aligned(cpu,v,bb), 64, false, bb)
 
 #define LOADMEM16(v) arch_load16_aligned(cpu,v,bb)
 #define LOADMEM32(v) arch_load32_aligned(cpu,v,bb)
+#define LOADMEM64(v) arch_load64_aligned(cpu,v,bb)
+
+/* for guests that allow misaligned access */
+#define LOADMEMU16(v) arch_load_unaligned(cpu,16,v,bb)
+#define LOADMEMU32(v) arch_load_unaligned(cpu,32,v,bb)
+#define LOADMEMU64(v) arch_load_unaligned(cpu,64,v,bb)
 
 #define STORE8(v,a) arch_store8(cpu,v, a, bb)
 #define STORE16(v,a) arch_store16(cpu,v, a, bb)
 #define STORE32(v,a) arch_store32_aligned(cpu,v, a, bb)
+#define STORE64(v,a) arch_store64_aligned(cpu,v, a, bb)
+#define STOREU16(v,a) arch_store_unaligned(cpu,16,v, a, bb)
+#define STOREU32(v,a) arch_store_unaligned(cpu,32,v, a, bb)
+#define STOREU64(v,a) arch_store_unaligned(cpu,64,v, a, bb)
 
 /* byte swap */
 #define SWAP16(v) arch_bswap(cpu, 16, v, bb)
@@ -234,9 +253,9 @@ uint32_t RAM32LE(uint8_t *RAM, addr_t a);
 #define FFC64(v) FFC(64,v)
 
 /* flags */
-#define SET_N(a) { Value *t = a; LET1(cpu->ptr_N, ICMP_SLT(t, CONSTs(SIZE(t), 0))); }
-#define SET_Z(a) { Value *t = a; LET1(cpu->ptr_Z, ICMP_EQ(t, CONSTs(SIZE(t), 0))); }
-#define SET_NZ(a) { Value *t2 = a; SET_N(t2); SET_Z(t2); }
+#define SET_N(a) { Value *t = a; arch_set_N(cpu, ICMP_SLT(t, CONSTs(SIZE(t), 0)), bb); }
+#define SET_Z(a) { Value *t = a; arch_set_Z(cpu, ICMP_EQ(t, CONSTs(SIZE(t), 0)), bb); }
+#define SET_NZ(a) arch_set_NZ(cpu, a, bb)
 #define CC_EQ LOAD(cpu->ptr_Z)
 #define CC_NE NOT(LOAD(cpu->ptr_Z))
 #define CC_CS LOAD(cpu->ptr_C)
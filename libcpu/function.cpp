@@ -13,10 +13,13 @@
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/Transforms/Utils/Local.h"
 
 #include "libcpu.h"
 #include "libcpu_llvm.h"
 #include "frontend.h" // XXX for arch_flags_encode() / arch_flags_decode()
+#include "budget.h"
+#include "objcache.h"
 
 //////////////////////////////////////////////////////////////////////
 // function
@@ -178,12 +181,10 @@ emit_decode_reg(cpu_t *cpu, BasicBlock *bb)
 	emit_decode_fp_reg_helper(cpu, bb);
 
 	// PC pointer.
-	IntegerType *intptr_type = cpu->dl->getIntPtrType(_CTX());
-	Constant *v_pc = ConstantInt::get(intptr_type, (uintptr_t)cpu->rf.pc);
-	cpu->ptr_PC = ConstantExpr::getIntToPtr(v_pc, PointerType::getUnqual(getIntegerType(cpu->info.address_size)));
-	cpu->ptr_PC->setName("pc");
+	cpu->ptr_PC = get_host_ptr(cpu, "__libcpu_pc", cpu->rf.pc, getIntegerType(cpu->info.address_size));
 
 	// flags
+	cpu->ptr_N = cpu->ptr_V = cpu->ptr_Z = cpu->ptr_C = NULL;
 	if (cpu->info.psr_size != 0) {
 		// declare flags
 		cpu_flags_layout_t const *flags_layout = cpu->info.flags_layout;
@@ -255,8 +256,8 @@ spill_fp_reg_state_helper(cpu_t *cpu, BasicBlock *bb)
 #endif
 }
 
-static void
-spill_reg_state(cpu_t *cpu, BasicBlock *bb)
+void
+cpu_spill_reg_state(cpu_t *cpu, BasicBlock *bb)
 {
 	// frontend specific part.
 	if (cpu->f.spill_reg_state != NULL)
@@ -280,6 +281,145 @@ spill_reg_state(cpu_t *cpu, BasicBlock *bb)
 	spill_fp_reg_state_helper(cpu, bb);
 }
 
+#ifdef OPT_LOCAL_REGISTERS
+static bool
+is_spill_block(cpu_t *cpu, BasicBlock *bb, BasicBlock *bb_ret)
+{
+	return bb == bb_ret || (cpu->bb_chain != NULL && bb == cpu->bb_chain) ||
+		cpu->bb_callout.count(bb) != 0;
+}
+
+/* a store of the local copy back to the register file */
+static StoreInst *
+get_spill_store(cpu_t *cpu, LoadInst *load, Value *in_ptr_r, BasicBlock *bb_ret)
+{
+	if (!is_spill_block(cpu, load->getParent(), bb_ret) || !load->hasOneUse())
+		return NULL;
+	StoreInst *store = dyn_cast<StoreInst>(*load->user_begin());
+	if (store == NULL || store->getPointerOperand() != in_ptr_r)
+		return NULL;
+	return store;
+}
+
+/*
+ * Drop the copy of a register the translated code doesn't touch, and
+ * the spill of one it doesn't write.
+ */
+static bool
+prune_reg(cpu_t *cpu, Value *ptr_r, Value *in_ptr_r, BasicBlock *bb_entry, BasicBlock *bb_ret)
+{
+	std::vector<StoreInst *> spills;
+	bool used = false, dirty = false;
+
+	for (Value::user_iterator u = ptr_r->user_begin(); u != ptr_r->user_end(); u++) {
+		Instruction *i = cast<Instruction>(*u);
+		if (i->getParent() == bb_entry)
+			continue;
+		if (isa<StoreInst>(i)) {
+			dirty = true;
+			continue;
+		}
+		StoreInst *spill = isa<LoadInst>(i) ? get_spill_store(cpu, cast<LoadInst>(i), in_ptr_r, bb_ret) : NULL;
+		if (spill != NULL)
+			spills.push_back(spill);
+		else
+			used = true;
+	}
+	if (dirty)
+		return false;
+
+	for (size_t i = 0; i < spills.size(); i++) {
+		Instruction *load = cast<Instruction>(spills[i]->getValueOperand());
+		spills[i]->eraseFromParent();
+		load->eraseFromParent();
+	}
+	if (used)
+		return false;
+
+	/* only the copy in the entry block is left, unless it reads the register too */
+	for (Value::user_iterator u = ptr_r->user_begin(); u != ptr_r->user_end(); u++) {
+		if (!isa<StoreInst>(*u))
+			return false;
+	}
+	while (!ptr_r->use_empty()) {
+		StoreInst *store = cast<StoreInst>(*ptr_r->user_begin());
+		Value *v = store->getValueOperand();
+		store->eraseFromParent();
+		RecursivelyDeleteTriviallyDeadInstructions(v);
+	}
+	cast<Instruction>(ptr_r)->eraseFromParent();
+	return true;
+}
+
+/* the flags are written back into XR 0 unless no flag is ever set */
+static void
+prune_flags(cpu_t *cpu, BasicBlock *bb_entry, BasicBlock *bb_ret)
+{
+	std::vector<Value *> flags;
+	cpu_flags_layout_t const *flags_layout = cpu->info.flags_layout;
+
+	for (size_t i = 0; i < cpu->info.flags_count; i++) {
+		if (cpu->ptr_FLAG[flags_layout[i].shift] != NULL)
+			flags.push_back(cpu->ptr_FLAG[flags_layout[i].shift]);
+	}
+	for (size_t i = 0; i < flags.size(); i++) {
+		for (Value::user_iterator u = flags[i]->user_begin(); u != flags[i]->user_end(); u++) {
+			if (isa<StoreInst>(*u) && cast<Instruction>(*u)->getParent() != bb_entry)
+				return;
+		}
+	}
+
+	std::vector<StoreInst *> encodes;
+	for (Value::user_iterator u = cpu->ptr_xr[0]->user_begin(); u != cpu->ptr_xr[0]->user_end(); u++) {
+		StoreInst *store = dyn_cast<StoreInst>(*u);
+		if (store != NULL && is_spill_block(cpu, store->getParent(), bb_ret))
+			encodes.push_back(store);
+	}
+	for (size_t i = 0; i < encodes.size(); i++) {
+		Value *v = encodes[i]->getValueOperand();
+		encodes[i]->eraseFromParent();
+		RecursivelyDeleteTriviallyDeadInstructions(v);
+	}
+}
+
+static void
+prune_regclass(cpu_t *cpu, size_t count, Value **ptr_r, Value **in_ptr_r,
+	BasicBlock *bb_entry, BasicBlock *bb_ret)
+{
+	for (size_t i = 0; i < count; i++) {
+		if (ptr_r[i] != NULL && isa<AllocaInst>(ptr_r[i]) &&
+			prune_reg(cpu, ptr_r[i], in_ptr_r[i], bb_entry, bb_ret))
+			ptr_r[i] = NULL;
+	}
+}
+#endif
+
+/*
+ * After translation: only load the guest registers the unit uses
+ * and only write back those it may have modified.
+ */
+void
+cpu_prune_reg_state(cpu_t *cpu, BasicBlock *bb_entry, BasicBlock *bb_ret)
+{
+#ifdef OPT_LOCAL_REGISTERS
+	/* the flags spill writes XR 0, do them first */
+	if (cpu->info.psr_size != 0)
+		prune_flags(cpu, bb_entry, bb_ret);
+
+	prune_regclass(cpu, cpu->info.regclass_count[CPU_REGCLASS_GPR],
+		cpu->ptr_gpr, cpu->in_ptr_gpr, bb_entry, bb_ret);
+	prune_regclass(cpu, cpu->info.regclass_count[CPU_REGCLASS_XR],
+		cpu->ptr_xr, cpu->in_ptr_xr, bb_entry, bb_ret);
+
+	size_t count = cpu->info.regclass_count[CPU_REGCLASS_FPR];
+	uint32_t width = cpu->info.float_size;
+	if ((width == 80 && (cpu->flags & CPU_FLAG_FP80) == 0) ||
+		(width == 128 && (cpu->flags & CPU_FLAG_FP128) == 0))
+		count *= 2;
+	prune_regclass(cpu, count, cpu->ptr_fpr, cpu->in_ptr_fpr, bb_entry, bb_ret);
+#endif
+}
+
 Function*
 cpu_create_function(cpu_t *cpu, const char *name,
 	BasicBlock **p_bb_ret,
@@ -326,7 +466,7 @@ cpu_create_function(cpu_t *cpu, const char *name,
 		type_func,				/* Type */
 		GlobalValue::ExternalLinkage,	/* Linkage */
 		name,	/* Name */
-		cpu->mod[cpu->functions]);
+		cpu->mod);
 	func->setCallingConv(CallingConv::C);
 	func->addAttribute(1U, Attribute::NoCapture);
 	func->addAttribute(4294967295U, Attribute::NoUnwind);
@@ -342,6 +482,8 @@ cpu_create_function(cpu_t *cpu, const char *name,
 	cpu->ptr_func_debug = args++;
 	cpu->ptr_func_debug->setName("debug");
 
+	cpu->bb_callout.clear();
+
 	// entry basicblock
 	BasicBlock *label_entry = BasicBlock::Create(_CTX(), "entry", func, 0);
 	emit_decode_reg(cpu, label_entry);
@@ -361,7 +503,7 @@ cpu_create_function(cpu_t *cpu, const char *name,
 
 	// create ret basicblock
 	BasicBlock *bb_ret = BasicBlock::Create(_CTX(), "ret", func, 0);  
-	spill_reg_state(cpu, bb_ret);
+	cpu_spill_reg_state(cpu, bb_ret);
 	ReturnInst::Create(_CTX(), new LoadInst(exit_code, "", false, 0, bb_ret), bb_ret);
 	// create trap return basicblock
 	BasicBlock *bb_trap = BasicBlock::Create(_CTX(), "trap", func, 0);  
@@ -369,6 +511,44 @@ cpu_create_function(cpu_t *cpu, const char *name,
 	// return
 	BranchInst::Create(bb_ret, bb_trap);
 
+	// create memory fault return basicblock: the soft MMU found no
+	// mapping for an access. Spills the registers as they are then.
+	if (cpu->tlb != NULL) {
+		BasicBlock *bb_memfault = BasicBlock::Create(_CTX(), "memfault", func, 0);
+		new StoreInst(ConstantInt::get(XgetType(Int32Ty), JIT_RETURN_MEMFAULT), exit_code, false, 0, bb_memfault);
+		BranchInst::Create(bb_ret, bb_memfault);
+		cpu->bb_memfault = bb_memfault;
+	} else
+		cpu->bb_memfault = NULL;
+
+	// create budget return basicblock: the instruction budget is
+	// used up at the start of a basic block.
+	if (budget_enabled(cpu)) {
+		BasicBlock *bb_budget = BasicBlock::Create(_CTX(), "budget", func, 0);
+		new StoreInst(ConstantInt::get(XgetType(Int32Ty), JIT_RETURN_BUDGET), exit_code, false, 0, bb_budget);
+		BranchInst::Create(bb_ret, bb_budget);
+		cpu->bb_budget = bb_budget;
+	} else
+		cpu->bb_budget = NULL;
+
+	// create chain basicblock: spill and continue in another function
+	// without returning to cpu_run. Not used when single stepping.
+	if (cpu->flags_debug & (CPU_DEBUG_SINGLESTEP | CPU_DEBUG_SINGLESTEP_BB)) {
+		cpu->bb_chain = NULL;
+		cpu->ptr_chain_fp = NULL;
+	} else {
+		cpu->ptr_chain_fp = new AllocaInst(PointerType::getUnqual(type_func), 0, "chain_fp", label_entry);
+		BasicBlock *bb_chain = BasicBlock::Create(_CTX(), "chain", func, 0);
+		cpu_spill_reg_state(cpu, bb_chain);
+		std::vector<Value*> chain_args;
+		for (Function::arg_iterator a = func->arg_begin(); a != func->arg_end(); a++)
+			chain_args.push_back(&*a);
+		CallInst *call = CallInst::Create(new LoadInst(cpu->ptr_chain_fp, "", false, 0, bb_chain), chain_args, "", bb_chain);
+		call->setTailCallKind(CallInst::TCK_MustTail);
+		ReturnInst::Create(_CTX(), call, bb_chain);
+		cpu->bb_chain = bb_chain;
+	}
+
 	*p_bb_ret = bb_ret;
 	*p_bb_trap = bb_trap;
 	*p_label_entry = label_entry;
@@ -1 +1,3 @@
 Function *cpu_create_function(cpu_t *cpu, const char *name, BasicBlock **p_bb_ret, BasicBlock **p_bb_trap, BasicBlock **p_label_entry);
+void cpu_prune_reg_state(cpu_t *cpu, BasicBlock *bb_entry, BasicBlock *bb_ret);
+void cpu_spill_reg_state(cpu_t *cpu, BasicBlock *bb);
@@ -9,6 +9,7 @@
 #include <inttypes.h>
 
 #include <memory>
+#include <algorithm>
 
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/LinkAllPasses.h"
@@ -17,15 +18,27 @@
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/Target/TargetMachine.h"
 
 /* project global headers */
 #include "libcpu.h"
 #include "libcpu_llvm.h"
 #include "tag.h"
+#include "tagcache.h"
 #include "translate_all.h"
 #include "translate_singlestep.h"
 #include "translate_singlestep_bb.h"
 #include "function.h"
+#include "basicblock.h"
+#include "callout.h"
+#include "call.h"
+#include "cache.h"
+#include "objcache.h"
+#include "fastmem.h"
+#include "softmmu.h"
+#include "region.h"
+#include "async.h"
+#include "tier.h"
 #include "optimize.h"
 #include "stat.h"
 #include "x86_internal.h"
@@ -41,6 +54,21 @@ extern arch_func_t arch_func_fapra;
 
 #define IS_LITTLE_ENDIAN(cpu) (((cpu)->info.common_flags & CPU_FLAG_ENDIAN_MASK) == CPU_FLAG_ENDIAN_LITTLE)
 
+static CodeGenOpt::Level
+backend_opt_level(unsigned level)
+{
+	switch (level) {
+	case 0:
+		return CodeGenOpt::None;
+	case 1:
+		return CodeGenOpt::Less;
+	case 2:
+		return CodeGenOpt::Default;
+	default:
+		return CodeGenOpt::Aggressive;
+	}
+}
+
 static inline bool
 is_valid_gpr_size(cpu_t *cpu, uint32_t offset, uint32_t count)
 {
@@ -86,6 +114,35 @@ is_valid_vr_size(cpu_t *cpu, uint32_t offset, uint32_t count)
 	return true;
 }
 
+/* the generated code runs on this host */
+static orc::JITTargetMachineBuilder
+host_jtmb()
+{
+	orc::JITTargetMachineBuilder jtmb = *orc::JITTargetMachineBuilder::detectHost();
+	SubtargetFeatures features;
+	StringMap<bool> host_features;
+	if (sys::getHostCPUFeatures(host_features))
+		for (auto &F : host_features) {
+			features.AddFeature(F.first(), F.second);
+		}
+	jtmb.setCPU(sys::getHostCPUName())
+		.addFeatures(features.getFeatures())
+		.setRelocationModel(None)
+		.setCodeModel(None);
+	return jtmb;
+}
+
+static void
+create_jit(cpu_t *cpu)
+{
+	// XXX use sys::getHostNumPhysicalCores from LLVM to exclude logical cores?
+	auto lazyjit = orc::LLLazyJIT::Create(host_jtmb(), *cpu->dl, NULL, std::thread::hardware_concurrency());
+	assert(lazyjit);
+	cpu->jit = std::move(*lazyjit);
+	cpu->jit->setPartitionFunction(orc::CompileOnDemandLayer::compileRequested);
+	objcache_init(cpu);
+}
+
 //////////////////////////////////////////////////////////////////////
 // cpu_t
 //////////////////////////////////////////////////////////////////////
@@ -133,14 +190,40 @@ cpu_new(cpu_arch_t arch, uint32_t flags, uint32_t arch_flags)
 	cpu->code_start = 0;
 	cpu->code_end = 0;
 	cpu->code_entry = 0;
-	cpu->tag = NULL;
-
-	uint32_t i;
-	for (i = 0; i < sizeof(cpu->func)/sizeof(*cpu->func); i++)
-		cpu->func[i] = NULL;
-	for (i = 0; i < sizeof(cpu->fp)/sizeof(*cpu->fp); i++)
-		cpu->fp[i] = NULL;
-	cpu->functions = 0;
+	cpu->tag_root = NULL;
+	cpu->tag_levels = 0;
+	cpu->tag_last_page = NULL;
+	cpu->tag_last_index = 0;
+	cpu->tag_pages = 0;
+	cpu->tag_unsaved = 0;
+	cpu->tag_shift = 0;
+	cpu->tag_slots = 0;
+
+	cpu->next_unit_id = 0;
+	cpu->cur_unit = NULL;
+	cpu->cache_size = 0;
+	cpu->cache_flush_size = 0;
+	cpu->cache_dir_checked = false;
+	cpu->run_depth = 0;
+	memset(&cpu->cache_stats, 0, sizeof(cpu->cache_stats));
+	cpu->async = NULL;
+	cpu->fastmem = NULL;
+	cpu->fault_pc = 0;
+	cpu->fault_addr = 0;
+	cpu->page_walk = NULL;
+	cpu->tlb = NULL;
+	cpu->bb_memfault = NULL;
+	cpu->budget = INT64_MAX;
+	cpu->bb_budget = NULL;
+	cpu->cur_flags_dead = 0;
+	cpu->compile_threads = 1;
+	cpu->tier_hot = 0;
+	cpu->code_ready = 0;
+	cpu->exit_request = 0;
+	cpu->tier_threshold = 10000;
+	memset(&cpu->tier_stats, 0, sizeof(cpu->tier_stats));
+	cpu->pass_hook = NULL;
+	memset(&cpu->level_stats, 0, sizeof(cpu->level_stats));
 
 	cpu->flags_codegen = CPU_CODEGEN_OPTIMIZE;
 	cpu->flags_debug = CPU_DEBUG_NONE;
@@ -203,34 +286,25 @@ cpu_new(cpu_arch_t arch, uint32_t flags, uint32_t arch_flags)
 	InitializeNativeTarget();
 	InitializeNativeTargetAsmParser();
 	InitializeNativeTargetAsmPrinter();
-	cpu->ctx[cpu->functions] = new LLVMContext();
-	assert(cpu->ctx[cpu->functions] != NULL);
-	cpu->mod[cpu->functions] = new Module(cpu->info.name, _CTX());
-	assert(cpu->mod[cpu->functions] != NULL);
-	const auto& tt = cpu->mod[cpu->functions]->getTargetTriple();
-	orc::JITTargetMachineBuilder jtmb =
-		tt.empty() ? *orc::JITTargetMachineBuilder::detectHost()
-		: orc::JITTargetMachineBuilder(Triple(tt));
-	SubtargetFeatures features;
-	StringMap<bool> host_features;
-	if (sys::getHostCPUFeatures(host_features))
-		for (auto &F : host_features) {
-			features.AddFeature(F.first(), F.second);
-		}
-	jtmb.setCPU(sys::getHostCPUName())
-		.addFeatures(features.getFeatures())
-		.setRelocationModel(None)
-		.setCodeModel(None);
+	cpu->ctx = new LLVMContext();
+	assert(cpu->ctx != NULL);
+	cpu->mod = new Module(cpu->info.name, _CTX());
+	assert(cpu->mod != NULL);
+	orc::JITTargetMachineBuilder jtmb = host_jtmb();
 	auto dl = jtmb.getDefaultDataLayoutForTarget();
 	assert(dl);
 	cpu->dl = new DataLayout(*dl);
-	// XXX use sys::getHostNumPhysicalCores from LLVM to exclude logical cores?
-	auto lazyjit = orc::LLLazyJIT::Create(std::move(jtmb), *dl, NULL, std::thread::hardware_concurrency());
-	assert(lazyjit);
-	cpu->jit = std::move(*lazyjit);
-	cpu->jit->setPartitionFunction(orc::CompileOnDemandLayer::compileRequested);
-	cpu->jit->getMainJITDylib().setGenerator(
-		*orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(*dl));
+	// units for the object cache are linked at arbitrary addresses
+	orc::JITTargetMachineBuilder objtmb = jtmb;
+	objtmb.setRelocationModel(Reloc::PIC_);
+	for (unsigned level = 0; level < CPU_OPT_LEVELS; level++) {
+		auto tm = objtmb.createTargetMachine();
+		assert(tm);
+		cpu->tm_level[level] = tm->release();
+		cpu->tm_level[level]->setOptLevel(backend_opt_level(level));
+	}
+	cpu->tm_level[0]->setFastISel(true);
+	create_jit(cpu);
 
 	// check if FP80 and FP128 are supported by this architecture.
 	// XXX there is a better way to do this?
@@ -266,9 +340,19 @@ cpu_free(cpu_t *cpu)
 		//if (cpu->cur_func != NULL) {
 		//	cpu->cur_func->eraseFromParent();
 		//}
+		async_stop(cpu);
+		cache_free(cpu);
 		llvm_shutdown();
 		cpu->jit.reset(NULL);
 	}
+	tagcache_flush(cpu, true);
+	free_tagging(cpu);
+	fastmem_free(cpu);
+	softmmu_free(cpu);
+	for (unsigned level = 0; level < CPU_OPT_LEVELS; level++) {
+		if (cpu->tm_level[level] != NULL)
+			delete cpu->tm_level[level];
+	}
 	if (cpu->dl != NULL)
 		delete cpu->dl;
 	if (cpu->ptr_FLAG != NULL)
@@ -295,6 +379,80 @@ cpu_set_ram(cpu_t*cpu, uint8_t *r)
 	cpu->RAM = r;
 }
 
+/*
+ * Allocate size bytes of guest RAM at the start of a reservation of
+ * the whole guest address space, and use it. Accesses outside of it
+ * make cpu_run return JIT_RETURN_MEMFAULT. Returns NULL if the host
+ * can't do this; the client then has to provide RAM itself.
+ */
+uint8_t *
+cpu_alloc_ram(cpu_t *cpu, size_t size)
+{
+	uint8_t *r = fastmem_alloc(cpu, size);
+	if (r != NULL)
+		cpu->RAM = r;
+	return r;
+}
+
+/*
+ * Translate guest memory accesses through a TLB, filled by walk. This
+ * only applies to code translated from now on, so the code cache is
+ * flushed. NULL turns the soft MMU off again.
+ */
+void
+cpu_set_page_walk(cpu_t *cpu, cpu_page_walk_t walk)
+{
+	cpu_flush(cpu);
+	cpu->page_walk = walk;
+	if (walk != NULL)
+		softmmu_init(cpu);
+	else
+		softmmu_free(cpu);
+}
+
+/*
+ * Map [start, start + len) as ROM or MMIO; everything else is RAM. ROM
+ * contents are taken from RAM and must be loaded before mapping it.
+ * Loads from ROM at addresses known at translation time are folded,
+ * stores to it are dropped. MMIO accesses call the callbacks. Like
+ * the soft MMU this changes the translated code, so the code cache is
+ * flushed. Fails if the region overlaps another one.
+ */
+bool
+cpu_map_region(cpu_t *cpu, addr_t start, addr_t len, uint32_t kind, const cpu_region_callbacks_t *callbacks)
+{
+	cpu_flush(cpu);
+	return region_map(cpu, start, len, kind, callbacks);
+}
+
+/*
+ * Run fn in place of the guest code at pc, e.g. a guest OS routine
+ * emulated on the host. Translated code calls it directly where it
+ * branches or calls to pc; the code cache is flushed for that. A NULL
+ * fn removes the callout again.
+ */
+void
+cpu_register_callout(cpu_t *cpu, addr_t pc, cpu_callout_t fn, void *opaque)
+{
+	cpu_flush(cpu);
+	callout_register(cpu, pc, fn, opaque);
+}
+
+/* the guest changed its page tables */
+void
+cpu_tlb_flush(cpu_t *cpu)
+{
+	if (cpu->tlb != NULL)
+		softmmu_flush(cpu);
+}
+
+void
+cpu_tlb_flush_page(cpu_t *cpu, addr_t vaddr)
+{
+	if (cpu->tlb != NULL)
+		softmmu_flush_page(cpu, vaddr);
+}
+
 void
 cpu_set_flags_codegen(cpu_t *cpu, uint32_t f)
 {
@@ -321,65 +479,112 @@ cpu_tag(cpu_t *cpu, addr_t pc)
 	update_timing(cpu, TIMER_TAG, false);
 }
 
+/*
+ * Translate the tagged code into a new unit. A slow unit only holds
+ * the basic block at the current pc and is not optimized; it runs
+ * that code while the real unit is compiled in the background.
+ * If hot is given, its basic blocks are recompiled at level 2 or
+ * higher and the new unit replaces it.
+ */
 static void
-cpu_translate_function(cpu_t *cpu)
+cpu_translate_function(cpu_t *cpu, bool slow, cpu_unit_t *hot)
 {
 	BasicBlock *bb_ret, *bb_trap, *label_entry, *bb_start;
+	void *fp;
+
+	cpu_unit_t *unit = cache_new_unit(cpu);
+	if (hot != NULL) {
+		LOG("unit %s is hot, recompiling\n", hot->name.c_str());
+		unit->replaces = hot;
+		hot->tiering = true;
+		cpu->tier_stats.promotions++;
+	} else if (!slow && tier_enabled(cpu)) {
+		unit->tier = 0;
+		cpu->tier_stats.quick_units++;
+	}
+	/* both are replaced by better code while they may be running */
+	unit->osr = slow || unit->tier == 0;
+	if (slow || unit->tier == 0)
+		unit->level = 0;
+	else if (hot != NULL)
+		unit->level = std::max(opt_level(cpu), 2u);
+	else
+		unit->level = opt_level(cpu);
+	cpu->level_stats.units[unit->level]++;
+	if (!slow && objcache_enabled(cpu)) {
+		/* a previous run may have compiled this unit already */
+		update_timing(cpu, TIMER_BE, true);
+		fp = objcache_load_unit(cpu);
+		update_timing(cpu, TIMER_BE, false);
+		if (fp != NULL) {
+			cpu->cur_func = NULL;
+			cache_commit_unit(cpu, unit, fp);
+			return;
+		}
+	}
 
-	if (cpu->ctx[cpu->functions] == NULL) {
-		cpu->ctx[cpu->functions] = new LLVMContext();
-		assert(cpu->ctx[cpu->functions] != NULL);
+	if (cpu->ctx == NULL) {
+		cpu->ctx = new LLVMContext();
+		assert(cpu->ctx != NULL);
 	}
-	if (cpu->mod[cpu->functions] == NULL) {
-		cpu->mod[cpu->functions] = new Module(cpu->info.name, _CTX());
-		assert(cpu->mod[cpu->functions] != NULL);
+	if (cpu->mod == NULL) {
+		cpu->mod = new Module(cpu->info.name, _CTX());
+		assert(cpu->mod != NULL);
 	}
 
 	/* create function and fill it with std basic blocks */
-	cpu->cur_func = cpu_create_function(cpu, std::to_string(cpu->functions).c_str(), &bb_ret, &bb_trap, &label_entry);
-	cpu->func[cpu->functions] = cpu->cur_func;
+	cpu->cur_func = cpu_create_function(cpu, unit->name.c_str(), &bb_ret, &bb_trap, &label_entry);
 
 	/* TRANSLATE! */
 	update_timing(cpu, TIMER_FE, true);
 	if (cpu->flags_debug & CPU_DEBUG_SINGLESTEP) {
 		bb_start = cpu_translate_singlestep(cpu, bb_ret, bb_trap);
-	} else if (cpu->flags_debug & CPU_DEBUG_SINGLESTEP_BB) {
+	} else if (slow || (cpu->flags_debug & CPU_DEBUG_SINGLESTEP_BB)) {
 		bb_start = cpu_translate_singlestep_bb(cpu, bb_ret, bb_trap);
 	} else {
-		bb_start = cpu_translate_all(cpu, bb_ret, bb_trap);
+		bb_start = cpu_translate_all(cpu, bb_ret, bb_trap, hot != NULL ? &hot->entries : NULL);
 	}
 	update_timing(cpu, TIMER_FE, false);
+	fix_split_basicblocks(cpu);
+	cpu_prune_reg_state(cpu, label_entry, bb_ret);
 
 	/* finish entry basicblock */
 	BranchInst::Create(bb_start, label_entry);
 
+	/* the basic blocks are only needed while translating */
+	cpu->func_bb.erase(cpu->cur_func);
+
 	/* make sure everything is OK */
 	verifyFunction(*cpu->cur_func, &llvm::errs());
 
 	if (cpu->flags_debug & CPU_DEBUG_PRINT_IR)
-		cpu->mod[cpu->functions]->print(llvm::errs(), NULL);
+		cpu->mod->print(llvm::errs(), NULL);
+
+	if (!slow && async_enabled(cpu)) {
+		async_submit(cpu, unit, cpu->cur_func);
+		return;
+	}
 
-	if (cpu->flags_codegen & CPU_CODEGEN_OPTIMIZE) {
-		LOG("*** Optimizing...");
-		optimize(cpu);
+	uint64_t usec = get_wall_usec(cpu);
+	if (unit->level != 0) {
+		LOG("*** Optimizing at level %u...", unit->level);
+		optimize(cpu, cpu->cur_func, unit->level, cpu->tm_level[unit->level]);
 		LOG("done.\n");
 		if (cpu->flags_debug & CPU_DEBUG_PRINT_IR_OPTIMIZED)
-			cpu->mod[cpu->functions]->print(llvm::errs(), NULL);
+			cpu->mod->print(llvm::errs(), NULL);
 	}
 
 	LOG("*** Translating...");
 	update_timing(cpu, TIMER_BE, true);
-	orc::ThreadSafeContext tsc(std::unique_ptr<LLVMContext>(cpu->ctx[cpu->functions]));
-	orc::ThreadSafeModule tsm(std::unique_ptr<llvm::Module>(cpu->mod[cpu->functions]), tsc);
-	auto err = cpu->jit->addLazyIRModule(std::move(tsm));
-	assert(!err);
-	auto fp = (void*)(cpu->jit->lookup(cpu->cur_func->getName())->getAddress());
-	cpu->fp[cpu->functions] = fp;
+	if (!slow && objcache_enabled(cpu))
+		fp = objcache_add_unit(cpu, cpu->tm_level[unit->level]);
+	else
+		fp = add_unit_object(cpu, cpu->tm_level[unit->level]);
 	assert(fp != NULL);
+	cpu->level_stats.compile_usec[unit->level] += get_wall_usec(cpu) - usec;
+	cache_commit_unit(cpu, unit, fp);
 	update_timing(cpu, TIMER_BE, false);
 	LOG("done.\n");
-
-	cpu->functions++;
 }
 
 /* forces ahead of time translation (e.g. for benchmarking the run) */
@@ -387,13 +592,29 @@ void
 cpu_translate(cpu_t *cpu)
 {
 	/* on demand translation */
-	if (cpu->tags_dirty)
-		cpu_translate_function(cpu);
+	if (cpu->tags_dirty) {
+		tagcache_flush(cpu, false);
+		cpu_translate_function(cpu, false, NULL);
+	}
 
 	cpu->tags_dirty = false;
 }
 
-typedef int (*fp_t)(uint8_t *RAM, void *grf, void *frf, debug_function_t fp);
+/* recompile the tier 0 units that have become hot */
+static void
+promote_hot_units(cpu_t *cpu)
+{
+	std::vector<cpu_unit_t *> hot;
+
+	cpu->tier_hot = 0;
+	for (std::vector<cpu_unit_t *>::iterator it = cpu->units.begin(); it != cpu->units.end(); it++) {
+		cpu_unit_t *unit = *it;
+		if (unit->tier == 0 && !unit->tiering && *unit->block_count >= cpu->tier_threshold)
+			hot.push_back(unit);
+	}
+	for (std::vector<cpu_unit_t *>::iterator it = hot.begin(); it != hot.end(); it++)
+		cpu_translate_function(cpu, false, *it);
+}
 
 #ifdef __GNUC__
 void __attribute__((noinline))
@@ -404,59 +625,169 @@ asm("nop");
 void breakpoint() {}
 #endif
 
-int
-cpu_run(cpu_t *cpu, debug_function_t debug_function)
+/*
+ * LLVM 8 has no resource trackers, the code of a unit is only freed
+ * together with the JIT. Over the flush size, drop all units and start
+ * over with a new JIT. No translated code may be running, it would
+ * return into freed memory.
+ */
+static void
+release_code(cpu_t *cpu)
 {
-	addr_t pc = 0, orig_pc = 0;
-	uint32_t i;
+	LOG("code cache full (%zu bytes), releasing it\n", cpu->cache_size);
+	cpu_flush(cpu);
+	cpu->jit.reset(NULL);
+	cache_free(cpu);
+	create_jit(cpu);
+}
+
+static int
+run_units(cpu_t *cpu, debug_function_t debug_function)
+{
+	addr_t pc;
 	int ret;
-	bool success;
-	bool do_translate = true;
 
-	/* try to find the entry in all functions */
 	while(true) {
-		if (do_translate) {
-			cpu_translate(cpu);
-			pc = cpu->f.get_pc(cpu, cpu->rf.grf);
+		/* before spending any time on translation */
+		if (cpu->exit_request)
+			return JIT_RETURN_EXIT;
+
+		/* translate whatever has been tagged so far */
+		cpu_translate(cpu);
+		/* pick up what the background threads have compiled */
+		async_install(cpu);
+		if (cpu->tier_hot)
+			promote_hot_units(cpu);
+
+		pc = cpu->f.get_pc(cpu, cpu->rf.grf);
+
+		if (cpu->budget <= 0)
+			return JIT_RETURN_BUDGET;
+		if (cpu->run_depth == 0 && cache_full(cpu))
+			release_code(cpu);
+
+		/* reached through an indirect branch or a return */
+		if (callout_registered(cpu, pc)) {
+			/* a cpu_call from the callout is nested in this run */
+			cpu->run_depth++;
+			callout_run(cpu, pc);
+			cpu->run_depth--;
+			continue;
 		}
 
-		orig_pc = pc;
-		success = false;
-		for (i = 0; i < cpu->functions; i++) {
-			fp_t FP = (fp_t)cpu->fp[i];
-			update_timing(cpu, TIMER_RUN, true);
-			breakpoint();
-			ret = FP(cpu->RAM, cpu->rf.grf, cpu->rf.frf, debug_function);
-			cpu->ctx[i] = NULL;
-			cpu->mod[i] = NULL;
-			update_timing(cpu, TIMER_RUN, false);
-			pc = cpu->f.get_pc(cpu, cpu->rf.grf);
-			if (ret != JIT_RETURN_FUNCNOTFOUND)
-				return ret;
+		/* find the unit that has a dispatch entry for pc */
+		cpu_unit_t *unit = cache_lookup(cpu, pc);
+		if (unit == NULL) {
 			if (!is_inside_code_area(cpu, pc))
-				return ret;
-			if (pc != orig_pc) {
-				success = true;
-				break;
+				return JIT_RETURN_FUNCNOTFOUND;
+			cpu->cache_stats.misses++;
+			if (!async_pending(cpu, pc)) {
+				LOG("{%" PRIx64 "}", pc);
+				cpu_tag(cpu, pc);
+				cpu_translate(cpu);
+				unit = cache_lookup(cpu, pc);
 			}
-		}
-		if (!success) {
-			LOG("{%" PRIx64 "}", pc);
-			cpu_tag(cpu, pc);
-			do_translate = true;
-		}
+			/* still compiling, take the slow path meanwhile */
+			if (unit == NULL && async_pending(cpu, pc)) {
+				cpu_translate_function(cpu, true, NULL);
+				unit = cache_lookup(cpu, pc);
+			}
+			if (unit == NULL)
+				return JIT_RETURN_FUNCNOTFOUND;
+		} else
+			cpu->cache_stats.hits++;
+
+		fp_t FP = (fp_t)unit->fp;
+		/* chained units run at their own level but count for this one */
+		uint32_t level = unit->level;
+		uint64_t usec = get_wall_usec(cpu);
+		update_timing(cpu, TIMER_RUN, true);
+		breakpoint();
+		cpu->run_depth++;
+		if (cpu->fastmem != NULL)
+			ret = fastmem_run(cpu, FP, debug_function);
+		else
+			ret = FP(cpu->RAM, cpu->rf.grf, cpu->rf.frf, debug_function);
+		cpu->run_depth--;
+		update_timing(cpu, TIMER_RUN, false);
+		cpu->level_stats.run_usec[level] += get_wall_usec(cpu) - usec;
+		if (ret != JIT_RETURN_FUNCNOTFOUND)
+			return ret;
+		pc = cpu->f.get_pc(cpu, cpu->rf.grf);
+		if (!is_inside_code_area(cpu, pc) && !callout_registered(cpu, pc))
+			return ret;
 	}
 }
 
+/* a stop request is for the outermost run, whatever it returns */
+static int
+run_done(cpu_t *cpu, int ret)
+{
+	if (cpu->run_depth == 0)
+		cpu->exit_request = 0;
+	return ret;
+}
+
+int
+cpu_run(cpu_t *cpu, debug_function_t debug_function)
+{
+	return run_done(cpu, run_units(cpu, debug_function));
+}
+
+/*
+ * Like cpu_run, but return JIT_RETURN_BUDGET once the guest has run
+ * about n instructions, with the pc at the basic block it would run
+ * next, so that cpu_run_budget can pick up from there. Only code
+ * translated with CPU_CODEGEN_BUDGET counts instructions; a block
+ * that starts within the budget runs to its end.
+ */
+int
+cpu_run_budget(cpu_t *cpu, uint64_t n, debug_function_t debug_function)
+{
+	cpu->budget = n > INT64_MAX ? INT64_MAX : (int64_t)n;
+	int ret = cpu_run(cpu, debug_function);
+	cpu->budget = INT64_MAX;
+	return ret;
+}
+
+/*
+ * Make cpu_run return JIT_RETURN_EXIT soon, at the next back edge,
+ * indirect branch or return of the guest code, with the pc at the
+ * instruction it would run next. Only sets a flag, so it can be
+ * called from another thread or from a signal handler. Runs nested
+ * in a callout return JIT_RETURN_EXIT as well and leave the request
+ * to the outer run; it is dropped when the outermost cpu_run or
+ * cpu_call returns, for whatever reason.
+ */
 void
-cpu_flush(cpu_t *cpu)
+cpu_request_exit(cpu_t *cpu)
 {
-	cpu->cur_func->eraseFromParent();
+	cpu->exit_request = 1;
+}
 
-	cpu->functions = 0;
+/*
+ * Call the guest function at addr with the arguments in args, the
+ * way the architecture's calling convention passes them, and run it
+ * until it returns. Returns JIT_RETURN_NOERR with the function's
+ * result in result, the return value of cpu_run if the function
+ * didn't return, or -1 if the architecture has no calling convention
+ * for that many arguments.
+ */
+int
+cpu_call(cpu_t *cpu, addr_t addr, const uint64_t *args, uint32_t nargs, uint64_t *result,
+	debug_function_t debug_function)
+{
+	return run_done(cpu, call_run(cpu, addr, args, nargs, result, debug_function));
+}
 
-	// reset bb caching mapping
-	cpu->func_bb.clear();
+void
+cpu_flush(cpu_t *cpu)
+{
+	// drop all units; this also resets the bb caching mapping
+	// and unlinks the chain slots.
+	async_drain(cpu);
+	cache_flush(cpu);
+	cpu->cur_func = NULL;
 }
 
 void
@@ -466,4 +797,81 @@ cpu_print_statistics(cpu_t *cpu)
 	printf("fe  = %8" PRId64 "\n", cpu->timer_total[TIMER_FE]);
 	printf("be  = %8" PRId64 "\n", cpu->timer_total[TIMER_BE]);
 	printf("run = %8" PRId64 "\n", cpu->timer_total[TIMER_RUN]);
+	printf("cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " flushes, %u units, %zu bytes\n",
+		cpu->cache_stats.hits, cpu->cache_stats.misses, cpu->cache_stats.flushes,
+		cpu->cache_stats.units, cpu->cache_size);
+	if (cpu->flags_codegen & CPU_CODEGEN_TIERED)
+		printf("tier: %" PRIu64 " quick units, %" PRIu64 " promotions\n",
+			cpu->tier_stats.quick_units, cpu->tier_stats.promotions);
+	for (unsigned level = 0; level < CPU_OPT_LEVELS; level++) {
+		if (cpu->level_stats.units[level] == 0)
+			continue;
+		printf("O%u: %" PRIu64 " units, compile = %8" PRIu64 ", run = %8" PRIu64 "\n", level,
+			cpu->level_stats.units[level], cpu->level_stats.compile_usec[level],
+			cpu->level_stats.run_usec[level]);
+	}
+}
+
+/*
+ * Limit the guest code translated at any time, 0 means unlimited. Past
+ * bytes, cpu_run flushes all translated code and translates again
+ * what runs next.
+ */
+void
+cpu_set_cache_flush_size(cpu_t *cpu, size_t bytes)
+{
+	cpu->cache_flush_size = bytes;
+}
+
+/*
+ * Keep the object cache in dir instead of $XDG_CACHE_HOME/libcpu. It
+ * is created if missing, and not used unless only the user can get
+ * into it.
+ */
+void
+cpu_set_cache_dir(cpu_t *cpu, const char *dir)
+{
+	cpu->cache_dir = dir;
+	cpu->cache_dir_checked = false;
+}
+
+/* basic blocks a tier 0 unit runs before it is recompiled */
+void
+cpu_set_tier_threshold(cpu_t *cpu, uint64_t blocks)
+{
+	cpu->tier_threshold = blocks;
+}
+
+void
+cpu_get_tier_stats(cpu_t *cpu, cpu_tier_stats_t *stats)
+{
+	*stats = cpu->tier_stats;
+}
+
+/* run custom passes after the level's pipeline, see cpu_pass_hook_t */
+void
+cpu_set_pass_hook(cpu_t *cpu, cpu_pass_hook_t hook)
+{
+	cpu->pass_hook = hook;
+}
+
+/* times are only measured with CPU_DEBUG_PROFILE */
+void
+cpu_get_level_stats(cpu_t *cpu, cpu_level_stats_t *stats)
+{
+	*stats = cpu->level_stats;
+}
+
+/* number of background compile threads, for CPU_CODEGEN_ASYNC */
+void
+cpu_set_compile_threads(cpu_t *cpu, uint32_t n)
+{
+	cpu->compile_threads = n;
+}
+
+void
+cpu_get_cache_stats(cpu_t *cpu, cpu_cache_stats_t *stats)
+{
+	*stats = cpu->cache_stats;
+	stats->size = cpu->cache_size;
 }
@@ -7,7 +7,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <deque>
 #include <map>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <memory>
 
 namespace llvm {
@@ -20,6 +25,7 @@ class PointerType;
 class StructType;
 class Value;
 class DataLayout;
+class TargetMachine;
 namespace orc {
 	class LLLazyJIT;
 }
@@ -31,6 +37,12 @@ namespace orc {
 using namespace llvm;
 
 struct cpu;
+struct cpu_unit;
+struct tag_node;
+struct tag_page;
+struct cpu_async;
+struct cpu_fastmem;
+struct cpu_tlb_entry;
 
 typedef void        (*fp_init)(struct cpu *cpu, struct cpu_archinfo *info, struct cpu_archrf *rf);
 typedef void        (*fp_done)(struct cpu *cpu);
@@ -44,6 +56,7 @@ typedef int         (*fp_tag_instr)(struct cpu *cpu, addr_t pc, tag_t *tag, addr
 typedef int         (*fp_disasm_instr)(struct cpu *cpu, addr_t pc, char *line, unsigned int max_line);
 typedef Value      *(*fp_translate_cond)(struct cpu *cpu, addr_t pc, BasicBlock *bb);
 typedef int         (*fp_translate_instr)(struct cpu *cpu, addr_t pc, BasicBlock *bb);
+typedef void        (*fp_flags_used)(struct cpu *cpu, addr_t pc, uint64_t *read, uint64_t *written);
 // @@@BEGIN_DEPRECATION
 // idbg support
 typedef uint64_t    (*fp_get_psr)(struct cpu *cpu, void *regs);
@@ -69,6 +82,8 @@ typedef struct {
 	fp_get_reg get_reg;
 	fp_get_fp_reg get_fp_reg;
 // @@@END_DEPRECATION
+	// flag liveness, bits are flag shifts; optional
+	fp_flags_used flags_used;
 } arch_func_t;
 
 typedef enum {
@@ -166,6 +181,16 @@ typedef struct cpu_register_layout {
 	char const *name;
 } cpu_register_layout_t;
 
+#define CPU_ABI_MAX_ARGS 8
+
+/* calling convention of cpu_call, by GPR number */
+typedef struct cpu_abi {
+	uint32_t arg_count;	/* GPRs that pass arguments */
+	uint32_t arg_reg[CPU_ABI_MAX_ARGS];
+	uint32_t result_reg;	/* GPR that returns the result */
+	uint32_t link_reg;	/* GPR that takes the return address */
+} cpu_abi_t;
+
 typedef struct cpu_archinfo {
 	cpu_arch_t type;
 	
@@ -183,6 +208,7 @@ typedef struct cpu_archinfo {
 	uint32_t vector_size;
 	uint32_t address_size;
 	uint32_t psr_size;
+	uint32_t instr_align; /* instructions start at multiples of this (power of 2), 0 means 1 */
 
 	uint32_t min_page_size;
 	uint32_t max_page_size;
@@ -194,6 +220,7 @@ typedef struct cpu_archinfo {
 	uint32_t register_count2;
 	cpu_flags_layout_t const *flags_layout;
 	uint32_t flags_count;
+	cpu_abi_t const *abi; /* NULL if cpu_call isn't supported */
 } cpu_archinfo_t;
 
 typedef struct cpu_archrf {
@@ -208,6 +235,73 @@ typedef struct cpu_archrf {
 
 typedef std::map<addr_t, BasicBlock *> bbaddr_map;
 typedef std::map<Function *, bbaddr_map> funcbb_map;
+typedef std::unordered_map<addr_t, struct cpu_unit *> entry_map;
+typedef std::unordered_map<addr_t, void *> chain_map;
+
+typedef struct cpu_cache_stats {
+	uint64_t hits;		/* cpu_run found translated code for pc */
+	uint64_t misses;	/* cpu_run had to translate pc first */
+	uint64_t flushes;	/* by cpu_flush or to stay within the flush size */
+	uint32_t units;		/* units currently in the cache */
+	size_t size;		/* guest code bytes currently translated */
+} cpu_cache_stats_t;
+
+typedef struct cpu_tier_stats {
+	uint64_t quick_units;	/* units compiled at tier 0 */
+	uint64_t promotions;	/* units recompiled with the full pipeline */
+} cpu_tier_stats_t;
+
+#define CPU_OPT_LEVELS 4
+
+typedef struct cpu_level_stats {
+	uint64_t units[CPU_OPT_LEVELS];		/* units compiled at each level */
+	uint64_t compile_usec[CPU_OPT_LEVELS];	/* optimization and code generation */
+	uint64_t run_usec[CPU_OPT_LEVELS];	/* time in units entered at each level */
+} cpu_level_stats_t;
+
+/*
+ * Soft MMU page walk: translate the guest virtual address vaddr for a
+ * read or write and return true, or return false if it faults.
+ */
+typedef bool (*cpu_page_walk_t)(struct cpu *cpu, addr_t vaddr, bool write, addr_t *paddr);
+
+/* memory region kinds, see cpu_map_region */
+enum {
+	CPU_REGION_RAM = 0,
+	CPU_REGION_ROM,
+	CPU_REGION_MMIO
+};
+
+typedef uint64_t (*cpu_mmio_read_t)(struct cpu *cpu, void *opaque, addr_t addr, uint32_t bits);
+typedef void (*cpu_mmio_write_t)(struct cpu *cpu, void *opaque, addr_t addr, uint32_t bits, uint64_t value);
+
+typedef struct cpu_region_callbacks {
+	cpu_mmio_read_t read;
+	cpu_mmio_write_t write;
+	void *opaque;
+} cpu_region_callbacks_t;
+
+typedef struct cpu_region {
+	addr_t start;
+	addr_t len;
+	uint32_t kind;
+	cpu_region_callbacks_t callbacks;
+} cpu_region_t;
+
+/*
+ * Runs in place of the guest code at pc, see cpu_register_callout.
+ * The guest registers are in the register file; it leaves the pc
+ * where the guest continues, e.g. at the return address.
+ */
+typedef void (*cpu_callout_t)(struct cpu *cpu, addr_t pc, void *opaque);
+
+typedef struct cpu_callout_entry {
+	cpu_callout_t fn;
+	void *opaque;
+} cpu_callout_entry_t;
+
+/* called after the level's passes ran, possibly on a compile thread */
+typedef void (*cpu_pass_hook_t)(struct cpu *cpu, Function *func, unsigned level);
 
 typedef struct cpu {
 	cpu_archinfo_t info;
@@ -215,6 +309,8 @@ typedef struct cpu {
 	arch_func_t f;
 
 	funcbb_map func_bb; // faster bb lookup
+	entry_map func_entry; // guest pc -> unit dispatching it
+	chain_map chain_slot; // guest pc -> compiled function to chain to, or NULL
 
 	uint16_t pc_offset;
 	addr_t code_start;
@@ -225,18 +321,60 @@ typedef struct cpu {
 	uint32_t flags_hint;
 	uint32_t flags;
 	uint8_t code_digest[20];
-	FILE *file_entries;
-	tag_t *tag;
+	std::vector<addr_t> tag_entries; // client entries, kept in the tag cache
+	uint32_t tag_unsaved; // entries not in the tag cache file yet
+	struct tag_node *tag_root; // radix tree of tag pages, one tag per instruction slot
+	uint32_t tag_levels;
+	struct tag_page *tag_last_page; // page used last, and its index
+	addr_t tag_last_index;
+	uint64_t tag_pages; // pages allocated
+	uint32_t tag_shift; // log2 of the slot size, see instr_align
+	addr_t tag_slots;
 	bool tags_dirty;
-	void *fp[1024];
-	Function *func[1024];
+	std::vector<addr_t> bb_worklist; // tagged basic block starts, maybe not translated yet
+	std::vector<struct cpu_unit *> units; // code cache
+	std::deque<uint64_t> unit_counters; // counted by the tier 0 units, see cache.cpp
+	uint32_t next_unit_id;
+	struct cpu_unit *cur_unit; // unit being translated
+	size_t cache_size; // guest code bytes in the cache
+	size_t cache_flush_size; // 0: unlimited
+	std::string cache_dir; // object cache, see cachedir.cpp
+	bool cache_dir_checked;
+	uint32_t run_depth; // runs of translated code on the stack
+	cpu_cache_stats_t cache_stats;
+	struct cpu_async *async; // background compilation, created on demand
+	uint32_t compile_threads;
+	uint8_t tier_hot; // set by tier 0 code when a unit becomes hot
+	volatile uint8_t code_ready; // set by the compile threads when a unit is ready
+	volatile uint8_t exit_request; // set by cpu_request_exit
+	uint64_t tier_threshold; // basic blocks a tier 0 unit runs before recompilation
+	cpu_tier_stats_t tier_stats;
 	Function *cur_func;
-	uint32_t functions;
 	uint8_t *RAM;
+	struct cpu_fastmem *fastmem; // RAM reserved by cpu_alloc_ram
+	addr_t fault_pc; // basic block or instruction of the last JIT_RETURN_MEMFAULT
+	addr_t fault_addr; // guest address it accessed
+	cpu_page_walk_t page_walk; // soft MMU, see cpu_set_page_walk
+	struct cpu_tlb_entry *tlb;
+	uint32_t tlb_shift; // log2 of the page size
+	BasicBlock *bb_memfault; // returns JIT_RETURN_MEMFAULT
+	int64_t budget; // instructions left, see cpu_run_budget
+	BasicBlock *bb_budget; // returns JIT_RETURN_BUDGET
+	std::unordered_map<BasicBlock *, BasicBlock *> bb_split; // split block -> its start, see split_basicblock
+	std::unordered_set<BasicBlock *> bb_inner; // control flow of the splits themselves
+	std::vector<cpu_region_t> regions; // ROM and MMIO, the rest is RAM
+	std::map<addr_t, cpu_callout_entry_t> callouts; // host functions run in place of guest code
+	std::unordered_set<BasicBlock *> bb_callout; // blocks that call them and return
+	addr_t cur_pc; // instruction being translated
+	std::unordered_map<addr_t, uint64_t> flags_dead; // pc -> flags it writes that are never read
+	uint64_t cur_flags_dead; // of the instruction being translated
+	std::vector<uint32_t> gpr_offset; // byte offset of each GPR in the register file, for cpu_call
 	Value *ptr_PC;
 	Value *ptr_RAM;
 	PointerType *type_pfunc_callout;
 	Value *ptr_func_debug;
+	BasicBlock *bb_chain; // spills and tail calls into another function
+	Value *ptr_chain_fp;
 
 	Value *ptr_grf; // gpr register file
 	Value **ptr_gpr; // GPRs
@@ -263,16 +401,28 @@ typedef struct cpu {
 
 	/* LLVM specific variables */
 	std::unique_ptr<orc::LLLazyJIT> jit;
-	LLVMContext *ctx[1024];
-	Module *mod[1024];
+	LLVMContext *ctx; // context of the unit being translated
+	Module *mod; // module of the unit being translated
 	DataLayout *dl;
+	TargetMachine *tm_level[CPU_OPT_LEVELS]; // for compiling units to objects, per level
+	cpu_pass_hook_t pass_hook;
+	cpu_level_stats_t level_stats;
 } cpu_t;
 
 enum {
 	JIT_RETURN_NOERR = 0,
 	JIT_RETURN_FUNCNOTFOUND,
 	JIT_RETURN_SINGLESTEP,
-	JIT_RETURN_TRAP
+	JIT_RETURN_TRAP,
+	// access outside of cpu_alloc_ram RAM or not mapped by the page
+	// walk. The guest was at fault_pc, not necessarily at the pc; the
+	// registers are those of the instruction at fault_pc with the soft
+	// MMU, of the start of the basic block at fault_pc otherwise.
+	// Stores of that block before the fault are not undone, so going
+	// on from fault_pc repeats them.
+	JIT_RETURN_MEMFAULT,
+	JIT_RETURN_BUDGET, // cpu_run_budget ran out of instructions
+	JIT_RETURN_EXIT // stopped by cpu_request_exit
 };
 
 //////////////////////////////////////////////////////////////////////
@@ -287,13 +437,43 @@ enum {
 // translate all reachable code at a time, but only a
 // certain amount of code in advance, and translate more
 // on demand.
-// If this is turned off, we do "entry caching", i.e. we
-// create a file in /tmp that holds all entries to the code
-// (i.e. all start addresses that can't be found automatically),
-// and we start tagging at these addresses on load if the
-// cache exists.
+// If this is turned off, we do "tag caching", i.e. we
+// keep a file in the cache directory (see cpu_set_cache_dir())
+// that holds all entries to the code
+// (i.e. all start addresses that can't be found automatically)
+// and the tags found from them, and load it instead of tagging
+// again if the cache exists.
 #define CPU_CODEGEN_TAG_LIMIT (1<<2)
 
+// Compile units to object files and keep them in a private cache
+// directory (see cpu_set_cache_dir()), keyed by the code, the tags,
+// the flags, the host CPU and the LLVM version. Later runs of the
+// same guest load them instead of translating. Nothing removes old
+// files, the directory can be emptied at any time.
+#define CPU_CODEGEN_OBJCACHE (1<<3)
+
+// Optimize and compile new units on background threads. Until a
+// unit is ready, its code runs through small single step units.
+#define CPU_CODEGEN_ASYNC (1<<4)
+
+// Compile new units quickly without optimization, and recompile
+// them with the full pipeline once they have run a number of basic
+// blocks (see cpu_set_tier_threshold()).
+#define CPU_CODEGEN_TIERED (1<<5)
+
+// Optimization level of the IR pipeline and the code generator.
+// CPU_CODEGEN_OPTIMIZE alone selects level 1.
+#define CPU_CODEGEN_LEVEL_SHIFT 6
+#define CPU_CODEGEN_LEVEL_MASK (3<<CPU_CODEGEN_LEVEL_SHIFT)
+#define CPU_CODEGEN_O0 0
+#define CPU_CODEGEN_O1 (CPU_CODEGEN_OPTIMIZE | (1<<CPU_CODEGEN_LEVEL_SHIFT))
+#define CPU_CODEGEN_O2 (CPU_CODEGEN_OPTIMIZE | (2<<CPU_CODEGEN_LEVEL_SHIFT))
+#define CPU_CODEGEN_O3 (CPU_CODEGEN_OPTIMIZE | (3<<CPU_CODEGEN_LEVEL_SHIFT))
+
+// Count the instructions run at the start of every basic block, so
+// that cpu_run_budget can stop the guest after a number of them.
+#define CPU_CODEGEN_BUDGET (1<<8)
+
 //////////////////////////////////////////////////////////////////////
 // debug flags
 //////////////////////////////////////////////////////////////////////
@@ -343,10 +523,28 @@ API_FUNC void cpu_set_flags_hint(cpu_t *cpu, uint32_t f);
 API_FUNC void cpu_set_flags_debug(cpu_t *cpu, uint32_t f);
 API_FUNC void cpu_tag(cpu_t *cpu, addr_t pc);
 API_FUNC int cpu_run(cpu_t *cpu, debug_function_t debug_function);
+API_FUNC int cpu_run_budget(cpu_t *cpu, uint64_t n, debug_function_t debug_function);
+API_FUNC void cpu_request_exit(cpu_t *cpu);
+API_FUNC int cpu_call(cpu_t *cpu, addr_t addr, const uint64_t *args, uint32_t nargs, uint64_t *result,
+	debug_function_t debug_function = NULL);
 API_FUNC void cpu_translate(cpu_t *cpu);
 API_FUNC void cpu_set_ram(cpu_t *cpu, uint8_t *RAM);
+API_FUNC uint8_t *cpu_alloc_ram(cpu_t *cpu, size_t size);
+API_FUNC void cpu_set_page_walk(cpu_t *cpu, cpu_page_walk_t walk);
+API_FUNC void cpu_tlb_flush(cpu_t *cpu);
+API_FUNC void cpu_tlb_flush_page(cpu_t *cpu, addr_t vaddr);
+API_FUNC void cpu_register_callout(cpu_t *cpu, addr_t pc, cpu_callout_t fn, void *opaque);
+API_FUNC bool cpu_map_region(cpu_t *cpu, addr_t start, addr_t len, uint32_t kind, const cpu_region_callbacks_t *callbacks);
 API_FUNC void cpu_flush(cpu_t *cpu);
 API_FUNC void cpu_print_statistics(cpu_t *cpu);
+API_FUNC void cpu_set_cache_flush_size(cpu_t *cpu, size_t bytes);
+API_FUNC void cpu_set_cache_dir(cpu_t *cpu, const char *dir);
+API_FUNC void cpu_get_cache_stats(cpu_t *cpu, cpu_cache_stats_t *stats);
+API_FUNC void cpu_set_compile_threads(cpu_t *cpu, uint32_t n);
+API_FUNC void cpu_set_tier_threshold(cpu_t *cpu, uint64_t blocks);
+API_FUNC void cpu_get_tier_stats(cpu_t *cpu, cpu_tier_stats_t *stats);
+API_FUNC void cpu_set_pass_hook(cpu_t *cpu, cpu_pass_hook_t hook);
+API_FUNC void cpu_get_level_stats(cpu_t *cpu, cpu_level_stats_t *stats);
 
 /* runs the interactive debugger */
 API_FUNC int cpu_debugger(cpu_t *cpu, debug_function_t debug_function);
@@ -9,7 +9,7 @@
 // LLVM Helpers
 //////////////////////////////////////////////////////////////////////
 
-#define _CTX() (*cpu->ctx[cpu->functions])
+#define _CTX() (*cpu->ctx)
 
 #define XgetType(x) (Type::get##x(_CTX()))
 #define getIntegerType(x) (IntegerType::get(_CTX(), x))
@@ -0,0 +1,144 @@
+/*
+ * libcpu: liveness.cpp
+ *
+ * Flag liveness over the tagged code of a unit. The frontend's
+ * flags_used hook tells which flags an instruction reads and writes;
+ * a backward pass over the instructions then finds the flag writes
+ * that are overwritten before anything reads them, and the frontend
+ * doesn't emit those.
+ *
+ * Wherever the unit may be left, all flags are live: at calls,
+ * returns, traps, jumps to unknown or untranslated code or callouts,
+ * delay slots, back edges, which check for stop requests, and, with
+ * an instruction budget, the start of every basic block.
+ */
+
+#include "libcpu.h"
+#include "budget.h"
+#include "cache.h"
+#include "callout.h"
+#include "tag.h"
+#include "liveness.h"
+
+typedef struct {
+	addr_t pc;
+	uint64_t read;
+	uint64_t written;
+	bool conditional;	/* the writes may not happen */
+	bool exit;			/* the unit may be left after it */
+	addr_t succ[2];		/* NEW_PC_NONE if none */
+	uint64_t live_out;
+} liveness_instr_t;
+
+static void
+liveness_add_instr(cpu_t *cpu, addr_t pc, std::vector<liveness_instr_t> &instrs, addr_t *next)
+{
+	liveness_instr_t in;
+	addr_t new_pc, next_pc;
+	tag_t dummy;
+	tag_t tag = get_tag(cpu, pc);
+
+	cpu->f.tag_instr(cpu, pc, &dummy, &new_pc, &next_pc);
+	in.pc = pc;
+	in.read = 0;
+	in.written = 0;
+	cpu->f.flags_used(cpu, pc, &in.read, &in.written);
+	in.conditional = (tag & TAG_CONDITIONAL) != 0;
+	in.exit = (tag & (TAG_CALL | TAG_RET | TAG_TRAP | TAG_DELAY_SLOT)) != 0;
+	in.succ[0] = in.succ[1] = NEW_PC_NONE;
+	in.live_out = 0;
+
+	if (tag & (TAG_CONTINUE | TAG_CONDITIONAL))
+		in.succ[0] = next_pc;
+	if (tag & TAG_BRANCH) {
+		if (new_pc == NEW_PC_NONE || new_pc <= pc)
+			in.exit = true;
+		else
+			in.succ[1] = new_pc;
+	}
+	instrs.push_back(in);
+	*next = next_pc;
+}
+
+/*
+ * Compute the dead flag writes of the instructions in the unit's
+ * basic blocks, which are in cpu->func_bb already.
+ */
+void
+liveness_compute(cpu_t *cpu)
+{
+	std::vector<liveness_instr_t> instrs;
+	std::unordered_map<addr_t, size_t> index;
+
+	cpu->flags_dead.clear();
+	if (cpu->f.flags_used == NULL || cpu->info.psr_size == 0)
+		return;
+	/* a memory access may leave mid-block, with the flags as they are */
+	if (cpu->tlb != NULL)
+		return;
+
+	/* the instructions, the way cpu_translate_all walks them */
+	bbaddr_map &bb_addr = cpu->func_bb[cpu->cur_func];
+	for (bbaddr_map::const_iterator it = bb_addr.begin(); it != bb_addr.end(); it++) {
+		addr_t pc = it->first;
+		addr_t bb_end = tag_next_bb_start(cpu, pc + 1);
+		do {
+			if (index.count(pc))
+				break;
+			index[pc] = instrs.size();
+			addr_t next_pc;
+			liveness_add_instr(cpu, pc, instrs, &next_pc);
+			tag_t tag = get_tag(cpu, pc);
+			pc = next_pc;
+			if (pc > bb_end)
+				bb_end = tag_next_bb_start(cpu, pc);
+			if (!(tag & TAG_CONTINUE))
+				break;
+		} while (pc != bb_end && is_code(cpu, pc));
+	}
+
+	/* live flags only grow, iterate until they don't */
+	uint64_t all = ~(uint64_t)0;
+	bool budget = budget_enabled(cpu);
+	bool changed;
+	do {
+		changed = false;
+		for (size_t i = instrs.size(); i-- > 0; ) {
+			liveness_instr_t *in = &instrs[i];
+			uint64_t live = in->exit ? all : 0;
+			for (int s = 0; s < 2; s++) {
+				if (in->succ[s] == NEW_PC_NONE)
+					continue;
+				std::unordered_map<addr_t, size_t>::const_iterator j = index.find(in->succ[s]);
+				if (j == index.end() || callout_registered(cpu, in->succ[s]) ||
+					(budget && bb_addr.count(in->succ[s]))) {
+					live = all;
+					continue;
+				}
+				liveness_instr_t *succ = &instrs[j->second];
+				uint64_t kill = succ->conditional ? 0 : succ->written;
+				live |= succ->read | (succ->live_out & ~kill);
+			}
+			if (live != in->live_out) {
+				in->live_out = live;
+				changed = true;
+			}
+		}
+	} while (changed);
+
+	for (size_t i = 0; i < instrs.size(); i++) {
+		liveness_instr_t *in = &instrs[i];
+		uint64_t dead = in->written & ~in->live_out;
+		if (dead != 0 && !in->conditional && !in->exit)
+			cpu->flags_dead[in->pc] = dead;
+	}
+	LOG("liveness: %zu instructions, %zu with dead flags\n", instrs.size(), cpu->flags_dead.size());
+}
+
+/* flags the instruction at pc writes that nothing reads */
+uint64_t
+liveness_dead_flags(cpu_t *cpu, addr_t pc)
+{
+	std::unordered_map<addr_t, uint64_t>::const_iterator it = cpu->flags_dead.find(pc);
+	return it != cpu->flags_dead.end() ? it->second : 0;
+}
@@ -0,0 +1,2 @@
+void liveness_compute(cpu_t *cpu);
+uint64_t liveness_dead_flags(cpu_t *cpu, addr_t pc);
@@ -0,0 +1,481 @@
+/*
+ * libcpu: objcache.cpp
+ *
+ * Persistent object cache. Units are compiled to object files and
+ * stored in the cache directory (see cachedir.cpp), keyed by the guest
+ * code, the tags at translation time, the flags, the host CPU and the
+ * LLVM version. A later run that reaches the same unit loads the
+ * object instead of generating and compiling the IR again.
+ *
+ * Cached code cannot contain host addresses, so everything it needs
+ * from the host is referenced through __libcpu_* symbols that the
+ * JITDylib generator resolves when the object is linked.
+ */
+
+#include <inttypes.h>
+#ifdef _WIN32
+#include <io.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include "libcpu.h"
+#include "libcpu_llvm.h"
+#include "basicblock.h"
+#include "cache.h"
+#include "objcache.h"
+#include "sha1.h"
+#include "softmmu.h"
+#include "region.h"
+#include "callout.h"
+#include "tag.h"
+#include "cachedir.h"
+
+#define OBJCACHE_MAGIC		0x5543504c	/* "LPCU" */
+#define OBJCACHE_VERSION	2
+#define OBJCACHE_KEY_LENGTH	(2 * SHA_DIGEST_LENGTH)
+
+typedef struct objcache_header {
+	uint32_t magic;
+	uint32_t version;
+	char key[OBJCACHE_KEY_LENGTH];	/* the unit's key, not just its file name */
+	uint64_t size;		/* guest code bytes of the unit */
+	uint64_t obj_size;	/* object file follows the header */
+} objcache_header_t;
+
+#define SYM_PC		"__libcpu_pc"
+#define SYM_CPU		"__libcpu_cpu"
+#define SYM_FAULT_PC	"__libcpu_fault_pc"
+#define SYM_TLB		"__libcpu_tlb"
+#define SYM_TLB_FILL	"__libcpu_tlb_fill"
+#define SYM_REGION_READ	"__libcpu_region_read"
+#define SYM_REGION_WRITE	"__libcpu_region_write"
+#define SYM_CALLOUT	"__libcpu_callout"
+#define SYM_BUDGET	"__libcpu_budget"
+#define SYM_EXIT_REQUEST	"__libcpu_exit_request"
+#define SYM_CHAIN	"__libcpu_chain_"
+
+bool
+objcache_enabled(cpu_t *cpu)
+{
+	return (cpu->flags_codegen & CPU_CODEGEN_OBJCACHE) &&
+		!(cpu->flags_debug & (CPU_DEBUG_SINGLESTEP | CPU_DEBUG_SINGLESTEP_BB));
+}
+
+/*
+ * Return a pointer to host data at addr. Without the object cache
+ * this is just a constant, otherwise an external global resolved
+ * to addr when the unit is linked.
+ */
+Constant *
+get_host_ptr(cpu_t *cpu, const char *name, void *addr, Type *type)
+{
+	if (!objcache_enabled(cpu)) {
+		IntegerType *intptr_type = cpu->dl->getIntPtrType(_CTX());
+		return ConstantExpr::getIntToPtr(ConstantInt::get(intptr_type, (uintptr_t)addr),
+			PointerType::getUnqual(type));
+	}
+
+	GlobalVariable *gv = cpu->mod->getNamedGlobal(name);
+	if (gv == NULL)
+		gv = new GlobalVariable(*cpu->mod, type, false, GlobalValue::ExternalLinkage, NULL, name);
+	return gv;
+}
+
+/* Like get_host_ptr, for a host function the translated code calls */
+Constant *
+get_host_func(cpu_t *cpu, const char *name, void *addr, FunctionType *type)
+{
+	if (!objcache_enabled(cpu)) {
+		IntegerType *intptr_type = cpu->dl->getIntPtrType(_CTX());
+		return ConstantExpr::getIntToPtr(ConstantInt::get(intptr_type, (uintptr_t)addr),
+			PointerType::getUnqual(type));
+	}
+	return cpu->mod->getOrInsertFunction(name, type);
+}
+
+static void *
+lookup_host_symbol(cpu_t *cpu, StringRef name)
+{
+	if (name == SYM_PC)
+		return cpu->rf.pc;
+	if (name == SYM_CPU)
+		return cpu;
+	if (name == SYM_FAULT_PC)
+		return &cpu->fault_pc;
+	if (name == SYM_TLB)
+		return cpu->tlb;
+	if (name == SYM_TLB_FILL)
+		return (void *)softmmu_fill;
+	if (name == SYM_REGION_READ)
+		return (void *)region_read;
+	if (name == SYM_REGION_WRITE)
+		return (void *)region_write;
+	if (name == SYM_CALLOUT)
+		return (void *)callout_run;
+	if (name == SYM_BUDGET)
+		return &cpu->budget;
+	if (name == SYM_EXIT_REQUEST)
+		return (void *)&cpu->exit_request;
+	if (name.startswith(SYM_CHAIN)) {
+		unsigned long long pc;
+		if (name.drop_front(strlen(SYM_CHAIN)).getAsInteger(16, pc))
+			return NULL;
+		return &cpu->chain_slot[(addr_t)pc];
+	}
+	return NULL;
+}
+
+static Expected<orc::SymbolNameSet>
+generate_host_symbols(cpu_t *cpu, orc::DynamicLibrarySearchGenerator &process,
+	orc::JITDylib &jd, const orc::SymbolNameSet &names)
+{
+	orc::SymbolMap symbols;
+	orc::SymbolNameSet added, rest;
+	char prefix = cpu->dl->getGlobalPrefix();
+
+	for (auto &name : names) {
+		StringRef n = *name;
+		if (prefix != '\0' && !n.empty() && n.front() == prefix)
+			n = n.drop_front();
+		void *addr = lookup_host_symbol(cpu, n);
+		if (addr == NULL) {
+			rest.insert(name);
+			continue;
+		}
+		symbols[name] = JITEvaluatedSymbol(pointerToJITTargetAddress(addr), JITSymbolFlags::Exported);
+		added.insert(name);
+	}
+	if (!symbols.empty())
+		if (auto err = jd.define(orc::absoluteSymbols(std::move(symbols))))
+			return std::move(err);
+
+	/* everything else comes from the process, as before */
+	if (!rest.empty()) {
+		auto found = process(jd, rest);
+		if (!found)
+			return found.takeError();
+		added.insert(found->begin(), found->end());
+	}
+	return added;
+}
+
+/* resolve the __libcpu_* symbols, and process symbols as before */
+void
+objcache_init(cpu_t *cpu)
+{
+	orc::DynamicLibrarySearchGenerator process =
+		*orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(*cpu->dl);
+
+	cpu->jit->getMainJITDylib().setGenerator(
+		[cpu, process](orc::JITDylib &jd, const orc::SymbolNameSet &names) mutable {
+			return generate_host_symbols(cpu, process, jd, names);
+		});
+}
+
+/*
+ * Hash the code and the tags of the basic block at pc, walking it the
+ * way cpu_translate_all does, and the tag it ends at.
+ */
+static void
+digest_bb(cpu_t *cpu, SHA1_CTX *ctx, addr_t pc)
+{
+	addr_t bb_end = tag_next_bb_start(cpu, pc + 1);
+	uint64_t start = pc;
+	tag_t tag;
+
+	SHA1Update(ctx, (const unsigned char *)&start, sizeof(start));
+	do {
+		addr_t new_pc, next_pc;
+		tag_t dummy;
+
+		tag = get_tag(cpu, pc) & ~TAG_TRANSLATED;
+		addr_t len = cpu->f.tag_instr(cpu, pc, &dummy, &new_pc, &next_pc);
+		/* and the delay slot */
+		if (next_pc > pc + len)
+			len = next_pc - pc;
+		if (len > cpu->code_end - pc)
+			len = cpu->code_end - pc;
+		SHA1Update(ctx, (const unsigned char *)&tag, sizeof(tag));
+		SHA1Update(ctx, &cpu->RAM[pc], len);
+
+		pc = next_pc;
+		if (pc > bb_end)
+			bb_end = tag_next_bb_start(cpu, pc);
+	} while ((tag & TAG_CONTINUE) && pc != bb_end && is_code(cpu, pc));
+
+	tag = get_tag(cpu, pc) & ~TAG_TRANSLATED;
+	SHA1Update(ctx, (const unsigned char *)&tag, sizeof(tag));
+}
+
+/*
+ * Hash the region map and the ROM contents, which translated loads
+ * from ROM fold in. The ROM may be loaded after it is mapped, so this
+ * is done for every unit rather than once at map time.
+ */
+static void
+digest_regions(cpu_t *cpu, SHA1_CTX *ctx)
+{
+	for (size_t i = 0; i < cpu->regions.size(); i++) {
+		cpu_region_t *r = &cpu->regions[i];
+		uint64_t v[3] = { r->start, r->len, r->kind };
+		SHA1Update(ctx, (const unsigned char *)v, sizeof(v));
+		if (r->kind != CPU_REGION_ROM || cpu->RAM == NULL)
+			continue;
+		/* SHA1Update takes 32 bit lengths */
+		for (addr_t off = 0; off < r->len; ) {
+			uint32_t len = r->len - off > UINT32_MAX ? UINT32_MAX : (uint32_t)(r->len - off);
+			SHA1Update(ctx, &cpu->RAM[r->start + off], len);
+			off += len;
+		}
+	}
+}
+
+/*
+ * The key of the unit about to be translated. Its basic blocks, their
+ * code and their tags, together with the flags, the regions and the
+ * callouts determine the generated code. Only the unit's own blocks
+ * are hashed, a unit costs time in its size rather than the image's.
+ */
+static std::string
+unit_key(cpu_t *cpu)
+{
+	SHA1_CTX ctx;
+	uint8_t digest[SHA_DIGEST_LENGTH];
+	uint32_t v[8];
+	uint64_t code[2];
+	std::string host;
+	char ascii_digest[2 * SHA_DIGEST_LENGTH + 1];
+	std::vector<addr_t> bbs;
+
+	SHA1Init(&ctx);
+	/* the blocks cpu_translate_all will translate */
+	tag_new_bbs(cpu, bbs);
+	for (std::vector<addr_t>::const_iterator it = bbs.begin(); it != bbs.end(); it++)
+		digest_bb(cpu, &ctx, *it);
+	digest_regions(cpu, &ctx);
+	/* branches to these call out instead */
+	for (std::map<addr_t, cpu_callout_entry_t>::const_iterator i = cpu->callouts.begin(); i != cpu->callouts.end(); i++) {
+		uint64_t pc = i->first;
+		SHA1Update(&ctx, (const unsigned char *)&pc, sizeof(pc));
+	}
+
+	v[0] = cpu->info.type;
+	v[1] = cpu->info.common_flags;
+	v[2] = cpu->info.arch_flags;
+	v[3] = cpu->flags_codegen;
+	v[4] = cpu->flags_debug;
+	v[5] = cpu->flags_hint;
+	v[6] = cpu->fastmem != NULL; /* blocks record fault_pc */
+	v[7] = cpu->tlb != NULL ? cpu->tlb_shift : 0;
+	SHA1Update(&ctx, (const unsigned char *)v, sizeof(v));
+	code[0] = cpu->code_start;
+	code[1] = cpu->code_end;
+	SHA1Update(&ctx, (const unsigned char *)code, sizeof(code));
+
+	host = cpu->tm_level[0]->getTargetTriple().str() + "/" +
+		cpu->tm_level[0]->getTargetCPU().str() + "/" +
+		cpu->tm_level[0]->getTargetFeatureString().str() + "/" LLVM_VERSION_STRING;
+	SHA1Update(&ctx, (const unsigned char *)host.data(), host.size());
+	SHA1Final(digest, &ctx);
+
+	for (int i = 0; i < SHA_DIGEST_LENGTH; i++)
+		sprintf(ascii_digest + 2 * i, "%02x", digest[i]);
+	return ascii_digest;
+}
+
+/* "" if there is no cache directory */
+static std::string
+unit_file_name(cpu_t *cpu)
+{
+	const std::string &dir = cachedir_get(cpu);
+
+	if (dir.empty())
+		return "";
+	return dir + cpu->cur_unit->name + ".o";
+}
+
+static void *
+link_object(cpu_t *cpu, const std::string &name, std::unique_ptr<MemoryBuffer> obj)
+{
+	if (auto err = cpu->jit->addObjectFile(std::move(obj))) {
+		LOG("unit %s: cannot add object\n", name.c_str());
+		consumeError(std::move(err));
+		return NULL;
+	}
+	auto sym = cpu->jit->lookup(name);
+	if (!sym) {
+		LOG("unit %s: cannot link object\n", name.c_str());
+		consumeError(sym.takeError());
+		return NULL;
+	}
+	return (void *)sym->getAddress();
+}
+
+static void *
+link_unit(cpu_t *cpu, std::unique_ptr<MemoryBuffer> obj)
+{
+	return link_object(cpu, cpu->cur_unit->name, std::move(obj));
+}
+
+/*
+ * Name the unit being translated after its key, and load it if a
+ * previous run has compiled it already. Returns NULL on a miss.
+ */
+void *
+objcache_load_unit(cpu_t *cpu)
+{
+	cpu_unit_t *unit = cpu->cur_unit;
+	objcache_header_t hdr;
+	FILE *f;
+	int fd;
+
+	unit->name = "u" + unit_key(cpu);
+
+	std::string fn = unit_file_name(cpu);
+	if (fn.empty() || (fd = cachedir_open(cpu, fn)) < 0)
+		return NULL;
+	if (!(f = fdopen(fd, "rb"))) {
+		close(fd);
+		return NULL;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+			hdr.magic != OBJCACHE_MAGIC ||
+			hdr.version != OBJCACHE_VERSION ||
+			unit->name.compare(1, std::string::npos, hdr.key, sizeof(hdr.key)) != 0) {
+		LOG("unit %s: ignoring stale cache file\n", unit->name.c_str());
+		fclose(f);
+		return NULL;
+	}
+	std::unique_ptr<WritableMemoryBuffer> obj = WritableMemoryBuffer::getNewUninitMemBuffer(hdr.obj_size);
+	if (fread(obj->getBufferStart(), 1, hdr.obj_size, f) != hdr.obj_size) {
+		LOG("unit %s: truncated cache file\n", unit->name.c_str());
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+
+	void *fp = link_unit(cpu, std::move(obj));
+	if (fp == NULL)
+		return NULL;
+
+	/* these are the basic blocks cpu_translate_all() would have created */
+	std::vector<addr_t> bbs;
+	tag_take_new_bbs(cpu, bbs);
+	for (std::vector<addr_t>::const_iterator it = bbs.begin(); it != bbs.end(); it++) {
+		or_tag(cpu, *it, TAG_TRANSLATED);
+		cache_add_entry(cpu, *it);
+	}
+	unit->size = hdr.size;
+	LOG("unit %s: loaded from cache\n", unit->name.c_str());
+
+	return fp;
+}
+
+static void
+compile_module(cpu_t *cpu, Module *mod, TargetMachine *tm, SmallVectorImpl<char> &obj)
+{
+	raw_svector_ostream os(obj);
+	legacy::PassManager pm;
+
+	mod->setDataLayout(*cpu->dl);
+	mod->setTargetTriple(tm->getTargetTriple().str());
+	if (tm->addPassesToEmitFile(pm, os, nullptr, TargetMachine::CGFT_ObjectFile)) {
+		printf("error: the target cannot emit object files!\n");
+		exit(1);
+	}
+	pm.run(*mod);
+}
+
+/* compile cpu->mod with tm; this consumes cpu->mod and cpu->ctx */
+static void
+compile_unit(cpu_t *cpu, TargetMachine *tm, SmallVectorImpl<char> &obj)
+{
+	compile_module(cpu, cpu->mod, tm, obj);
+
+	delete cpu->mod;
+	delete cpu->ctx;
+	cpu->mod = NULL;
+	cpu->ctx = NULL;
+}
+
+/*
+ * Compile the unit being translated with tm and link it right away,
+ * bypassing the lazy compile layer and the cache files.
+ */
+void *
+add_unit_object(cpu_t *cpu, TargetMachine *tm)
+{
+	SmallVector<char, 0> obj;
+
+	compile_unit(cpu, tm, obj);
+	return link_unit(cpu, MemoryBuffer::getMemBufferCopy(StringRef(obj.data(), obj.size())));
+}
+
+/*
+ * Like add_unit_object, for the compile threads: the unit is given by
+ * its module and name, and tm must belong to the calling thread.
+ */
+void *
+add_module_object(cpu_t *cpu, Module *mod, const std::string &name, TargetMachine *tm)
+{
+	SmallVector<char, 0> obj;
+
+	compile_module(cpu, mod, tm, obj);
+	return link_object(cpu, name, MemoryBuffer::getMemBufferCopy(StringRef(obj.data(), obj.size())));
+}
+
+/*
+ * Compile the module of the unit being translated, store the object
+ * and link it. This consumes cpu->mod and cpu->ctx.
+ */
+void *
+objcache_add_unit(cpu_t *cpu, TargetMachine *tm)
+{
+	cpu_unit_t *unit = cpu->cur_unit;
+	SmallVector<char, 0> obj;
+
+	compile_unit(cpu, tm, obj);
+
+	/* write to a temporary file first, another process may be reading */
+	std::string fn = unit_file_name(cpu);
+	std::string tmp_fn = fn + ".tmp" + std::to_string(getpid());
+	FILE *f = NULL;
+	int fd;
+	if (fn.empty())
+		;
+	else if ((fd = cachedir_create(cpu, tmp_fn)) >= 0 && !(f = fdopen(fd, "wb")))
+		close(fd);
+	if (f != NULL) {
+		objcache_header_t hdr;
+		hdr.magic = OBJCACHE_MAGIC;
+		hdr.version = OBJCACHE_VERSION;
+		memcpy(hdr.key, unit->name.data() + 1, sizeof(hdr.key));
+		hdr.size = unit->size;
+		hdr.obj_size = obj.size();
+		bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+			fwrite(obj.data(), 1, obj.size(), f) == obj.size();
+		ok = (fclose(f) == 0) && ok;
+		if (!ok || rename(tmp_fn.c_str(), fn.c_str()) != 0) {
+			LOG("unit %s: cannot write cache file\n", unit->name.c_str());
+			remove(tmp_fn.c_str());
+		}
+	} else if (!fn.empty())
+		LOG("unit %s: cannot create cache file\n", unit->name.c_str());
+
+	return link_unit(cpu, MemoryBuffer::getMemBufferCopy(StringRef(obj.data(), obj.size())));
+}
@@ -0,0 +1,8 @@
+Constant *get_host_ptr(cpu_t *cpu, const char *name, void *addr, Type *type);
+Constant *get_host_func(cpu_t *cpu, const char *name, void *addr, FunctionType *type);
+void objcache_init(cpu_t *cpu);
+void *add_unit_object(cpu_t *cpu, TargetMachine *tm);
+void *add_module_object(cpu_t *cpu, Module *mod, const std::string &name, TargetMachine *tm);
+bool objcache_enabled(cpu_t *cpu);
+void *objcache_load_unit(cpu_t *cpu);
+void *objcache_add_unit(cpu_t *cpu, TargetMachine *tm);
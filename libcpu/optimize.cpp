@@ -1,28 +1,113 @@
 /*
  * libcpu: optimize.cpp
  *
- * Tell LLVM to run optimizers over the IR.
+ * Tell LLVM to run optimizers over the IR. The passes run depend on
+ * the optimization level (CPU_CODEGEN_O0..O3); the same level selects
+ * how hard the code generator works (see cpu_new()).
  */
 
-#include "llvm/ExecutionEngine/ExecutionEngine.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Utils.h"
 #include "llvm/IR/Module.h"
-#include "llvm/IR/LegacyPassManager.h"
-#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/ADCE.h"
+#include "llvm/Transforms/Scalar/CorrelatedValuePropagation.h"
+#include "llvm/Transforms/Scalar/DCE.h"
+#include "llvm/Transforms/Scalar/DeadStoreElimination.h"
+#include "llvm/Transforms/Scalar/EarlyCSE.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/JumpThreading.h"
+#include "llvm/Transforms/Scalar/LICM.h"
+#include "llvm/Transforms/Scalar/LoopPassManager.h"
+#include "llvm/Transforms/Scalar/LoopRotation.h"
+#include "llvm/Transforms/Scalar/LoopUnrollPass.h"
+#include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/SCCP.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Scalar/SROA.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
 
 #include "libcpu.h"
+#include "optimize.h"
 
-void
-optimize(cpu_t *cpu)
+/* the level selected by the codegen flags */
+unsigned
+opt_level(cpu_t *cpu)
 {
-	llvm::legacy::FunctionPassManager pm = llvm::legacy::FunctionPassManager(cpu->mod[cpu->functions]);
+	if (!(cpu->flags_codegen & CPU_CODEGEN_OPTIMIZE))
+		return 0;
 
-	pm.add(createPromoteMemoryToRegisterPass());
-	pm.add(createInstructionCombiningPass());
-	pm.add(createConstantPropagationPass());
-	pm.add(createDeadCodeEliminationPass());
-	pm.run(*cpu->cur_func);
+	unsigned level = (cpu->flags_codegen & CPU_CODEGEN_LEVEL_MASK) >> CPU_CODEGEN_LEVEL_SHIFT;
+	return level != 0 ? level : 1;
 }
 
+static void
+add_level_passes(FunctionPassManager &fpm, unsigned level)
+{
+	/* level 1: what we always did, cheap cleanups of the frontend output */
+	fpm.addPass(PromotePass());
+	fpm.addPass(InstCombinePass());
+	fpm.addPass(SCCPPass());
+	fpm.addPass(DCEPass());
+	if (level < 2)
+		return;
+
+	/* level 2: redundant guest register and memory accesses, loops */
+	fpm.addPass(SimplifyCFGPass());
+	fpm.addPass(SROA());
+	fpm.addPass(EarlyCSEPass());
+	fpm.addPass(JumpThreadingPass());
+	fpm.addPass(CorrelatedValuePropagationPass());
+	fpm.addPass(createFunctionToLoopPassAdaptor(LICMPass()));
+	fpm.addPass(GVN());
+	fpm.addPass(DSEPass());
+	fpm.addPass(InstCombinePass());
+	fpm.addPass(SimplifyCFGPass());
+	if (level < 3)
+		return;
+
+	/* level 3: rotate and unroll guest loops, then clean up again */
+	fpm.addPass(ReassociatePass());
+	fpm.addPass(createFunctionToLoopPassAdaptor(LoopRotatePass()));
+	fpm.addPass(createFunctionToLoopPassAdaptor(LICMPass()));
+	fpm.addPass(LoopUnrollPass(LoopUnrollOptions(3)));
+	fpm.addPass(GVN());
+	fpm.addPass(SCCPPass());
+	fpm.addPass(InstCombinePass());
+	fpm.addPass(JumpThreadingPass());
+	fpm.addPass(DSEPass());
+	fpm.addPass(ADCEPass());
+	fpm.addPass(SimplifyCFGPass());
+}
+
+/*
+ * Optimize func at level 1-3. This may run on a compile thread, so
+ * it only touches func's own context; tm, which gives the passes the
+ * target's cost model, may be NULL.
+ */
+void
+optimize(cpu_t *cpu, Function *func, unsigned level, TargetMachine *tm)
+{
+	if (level == 0)
+		return;
+
+	PassBuilder pb(tm);
+	LoopAnalysisManager lam;
+	FunctionAnalysisManager fam;
+	CGSCCAnalysisManager cgam;
+	ModuleAnalysisManager mam;
+
+	pb.registerModuleAnalyses(mam);
+	pb.registerCGSCCAnalyses(cgam);
+	pb.registerFunctionAnalyses(fam);
+	pb.registerLoopAnalyses(lam);
+	pb.crossRegisterProxies(lam, fam, cgam, mam);
+
+	FunctionPassManager fpm;
+	add_level_passes(fpm, level);
+	fpm.run(*func, fam);
+
+	if (cpu->pass_hook != NULL)
+		cpu->pass_hook(cpu, func, level);
+}
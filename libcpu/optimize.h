@@ -1 +1,2 @@
-void optimize(cpu_t *cpu);
+unsigned opt_level(cpu_t *cpu);
+void optimize(cpu_t *cpu, Function *func, unsigned level, TargetMachine *tm);
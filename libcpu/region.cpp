@@ -0,0 +1,105 @@
+/*
+ * libcpu: region.cpp
+ *
+ * Memory regions. By default all of the guest address space is RAM.
+ * The client can map ROM, whose contents (already in RAM) are folded
+ * into the translated code where the address is known, and MMIO,
+ * whose accesses go to host callbacks. The translated code calls
+ * region_read and region_write for the latter; these also take the
+ * accesses it could not resolve at translation time.
+ */
+
+#include <inttypes.h>
+
+#include "libcpu.h"
+#include "region.h"
+
+/* index of the region that holds [addr, addr + bytes), or -1 */
+int
+region_find(cpu_t *cpu, addr_t addr, uint32_t bytes)
+{
+	for (size_t i = 0; i < cpu->regions.size(); i++) {
+		cpu_region_t *r = &cpu->regions[i];
+		if (addr - r->start < r->len && addr - r->start + bytes <= r->len)
+			return (int)i;
+	}
+	return -1;
+}
+
+/* the regions of the given kinds are mapped */
+bool
+region_any(cpu_t *cpu, uint32_t kinds)
+{
+	for (size_t i = 0; i < cpu->regions.size(); i++) {
+		if (kinds & (1 << cpu->regions[i].kind))
+			return true;
+	}
+	return false;
+}
+
+/* the value a load from ROM at addr returns, as the translated code would read it */
+uint64_t
+region_rom_value(cpu_t *cpu, addr_t addr, uint32_t bits)
+{
+	const uint16_t one = 1;
+	/* a host order load, swapped with CPU_FLAG_SWAPMEM */
+	bool big = (*(const uint8_t *)&one == 0) != ((cpu->flags & CPU_FLAG_SWAPMEM) != 0);
+	uint32_t bytes = bits / 8;
+	uint64_t v = 0;
+
+	for (uint32_t i = 0; i < bytes; i++)
+		v |= (uint64_t)cpu->RAM[addr + i] << (8 * (big ? bytes - 1 - i : i));
+	return v;
+}
+
+uint64_t
+region_read(cpu_t *cpu, uint64_t addr, uint32_t bits, int32_t index)
+{
+	if (index < 0)
+		index = region_find(cpu, addr, bits / 8);
+	if (index < 0 || cpu->regions[index].callbacks.read == NULL)
+		return 0;
+	cpu_region_t *r = &cpu->regions[index];
+	return r->callbacks.read(cpu, r->callbacks.opaque, addr, bits);
+}
+
+void
+region_write(cpu_t *cpu, uint64_t addr, uint32_t bits, uint64_t value, int32_t index)
+{
+	if (index < 0)
+		index = region_find(cpu, addr, bits / 8);
+	/* writes to ROM are dropped */
+	if (index < 0 || cpu->regions[index].kind != CPU_REGION_MMIO ||
+		cpu->regions[index].callbacks.write == NULL)
+		return;
+	cpu_region_t *r = &cpu->regions[index];
+	r->callbacks.write(cpu, r->callbacks.opaque, addr, bits, value);
+}
+
+bool
+region_map(cpu_t *cpu, addr_t start, addr_t len, uint32_t kind, const cpu_region_callbacks_t *callbacks)
+{
+	if (len == 0 || kind > CPU_REGION_MMIO)
+		return false;
+	for (size_t i = 0; i < cpu->regions.size(); i++) {
+		cpu_region_t *r = &cpu->regions[i];
+		if (start < r->start + r->len && r->start < start + len) {
+			LOG("region %" PRIx64 "+%" PRIx64 " overlaps %" PRIx64 "+%" PRIx64 "\n",
+				start, len, r->start, r->len);
+			return false;
+		}
+	}
+
+	cpu_region_t r;
+	r.start = start;
+	r.len = len;
+	r.kind = kind;
+	if (callbacks != NULL)
+		r.callbacks = *callbacks;
+	else
+		memset(&r.callbacks, 0, sizeof(r.callbacks));
+	/* RAM is what isn't mapped otherwise */
+	if (kind != CPU_REGION_RAM)
+		cpu->regions.push_back(r);
+	return true;
+}
@@ -0,0 +1,6 @@
+int region_find(cpu_t *cpu, addr_t addr, uint32_t bytes);
+bool region_any(cpu_t *cpu, uint32_t kinds);
+uint64_t region_rom_value(cpu_t *cpu, addr_t addr, uint32_t bits);
+uint64_t region_read(cpu_t *cpu, uint64_t addr, uint32_t bits, int32_t index);
+void region_write(cpu_t *cpu, uint64_t addr, uint32_t bits, uint64_t value, int32_t index);
+bool region_map(cpu_t *cpu, addr_t start, addr_t len, uint32_t kind, const cpu_region_callbacks_t *callbacks);
@@ -0,0 +1,163 @@
+/*
+ * libcpu: softmmu.cpp
+ *
+ * Software MMU. With a page walk callback set, every guest memory
+ * access translates its virtual address through a direct mapped TLB
+ * inline in the translated code. A hit adds the page's physical
+ * offset to the address; a miss calls into the client's page walk,
+ * which fills the entry, or fails and makes the translated code
+ * return JIT_RETURN_MEMFAULT with fault_pc at the instruction.
+ *
+ * An access that crosses a page is translated by its first byte, and
+ * code is still fetched at its physical address.
+ */
+
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+
+#include "libcpu.h"
+#include "libcpu_llvm.h"
+#include "basicblock.h"
+#include "objcache.h"
+#include "softmmu.h"
+
+#define TLB_ENTRIES	256
+#define TLB_INVALID	((uint64_t)-1)
+/* returned by the fill on a fault, page offsets are multiples of pages */
+#define TLB_FAULT	1
+
+typedef struct cpu_tlb_entry {
+	uint64_t read;		/* page address readable through this entry */
+	uint64_t write;		/* page address writable through this entry */
+	uint64_t addend;	/* physical minus virtual page address */
+} cpu_tlb_entry_t;
+
+void
+softmmu_init(cpu_t *cpu)
+{
+	uint32_t page_size = cpu->info.default_page_size ? cpu->info.default_page_size : 4096;
+
+	if (cpu->tlb == NULL)
+		cpu->tlb = new cpu_tlb_entry_t[TLB_ENTRIES];
+	for (cpu->tlb_shift = 0; (1U << cpu->tlb_shift) < page_size; cpu->tlb_shift++)
+		;
+	softmmu_flush(cpu);
+}
+
+void
+softmmu_free(cpu_t *cpu)
+{
+	delete [] cpu->tlb;
+	cpu->tlb = NULL;
+}
+
+void
+softmmu_flush(cpu_t *cpu)
+{
+	for (unsigned i = 0; i < TLB_ENTRIES; i++) {
+		cpu->tlb[i].read = TLB_INVALID;
+		cpu->tlb[i].write = TLB_INVALID;
+	}
+}
+
+void
+softmmu_flush_page(cpu_t *cpu, addr_t vaddr)
+{
+	uint64_t page = vaddr & ~(((uint64_t)1 << cpu->tlb_shift) - 1);
+	cpu_tlb_entry_t *e = &cpu->tlb[(vaddr >> cpu->tlb_shift) & (TLB_ENTRIES - 1)];
+
+	if (e->read == page)
+		e->read = TLB_INVALID;
+	if (e->write == page)
+		e->write = TLB_INVALID;
+}
+
+/* called by translated code on a miss, returns the addend or TLB_FAULT */
+uint64_t
+softmmu_fill(cpu_t *cpu, uint64_t vaddr, uint32_t write)
+{
+	uint64_t mask = ((uint64_t)1 << cpu->tlb_shift) - 1;
+	cpu_tlb_entry_t *e = &cpu->tlb[(vaddr >> cpu->tlb_shift) & (TLB_ENTRIES - 1)];
+	addr_t paddr;
+
+	if (!cpu->page_walk(cpu, vaddr, write != 0, &paddr)) {
+		cpu->fault_addr = vaddr;
+		return TLB_FAULT;
+	}
+
+	uint64_t addend = (paddr & ~mask) - (vaddr & ~mask);
+	/* the entry maps one page; keep the other kind if it is the same */
+	if (e->addend != addend || (write ? e->read : e->write) != (vaddr & ~mask)) {
+		e->read = TLB_INVALID;
+		e->write = TLB_INVALID;
+	}
+	if (write)
+		e->write = vaddr & ~mask;
+	else
+		e->read = vaddr & ~mask;
+	e->addend = addend;
+	return addend;
+}
+
+static Value *
+get_fill_func(cpu_t *cpu)
+{
+	std::vector<Type *> args;
+	args.push_back(PointerType::getUnqual(cpu->dl->getIntPtrType(_CTX())));
+	args.push_back(getIntegerType(64));
+	args.push_back(getIntegerType(32));
+	FunctionType *type = FunctionType::get(getIntegerType(64), args, false);
+	return get_host_func(cpu, "__libcpu_tlb_fill", (void *)softmmu_fill, type);
+}
+
+/*
+ * Translate the guest virtual address a for a read or write access,
+ * returning the physical address to index RAM with.
+ */
+Value *
+softmmu_translate(cpu_t *cpu, Value *a, bool write, BasicBlock *bb)
+{
+	IntegerType *i64 = getIntegerType(64);
+	uint64_t mask = ((uint64_t)1 << cpu->tlb_shift) - 1;
+
+	if (a->getType()->getIntegerBitWidth() < 64)
+		a = new ZExtInst(a, i64, "", bb);
+
+	// look up the entry
+	Value *index = BinaryOperator::Create(Instruction::LShr, a, ConstantInt::get(i64, cpu->tlb_shift), "", bb);
+	index = BinaryOperator::Create(Instruction::And, index, ConstantInt::get(i64, TLB_ENTRIES - 1), "", bb);
+	index = BinaryOperator::Create(Instruction::Mul, index, ConstantInt::get(i64, 3), "", bb);
+	Constant *v_tlb = get_host_ptr(cpu, "__libcpu_tlb", cpu->tlb, i64);
+	Value *p_page = GetElementPtrInst::CreateInBounds(v_tlb,
+		BinaryOperator::Create(Instruction::Add, index, ConstantInt::get(i64, write ? 1 : 0), "", bb), "", bb);
+	Value *p_addend = GetElementPtrInst::CreateInBounds(v_tlb,
+		BinaryOperator::Create(Instruction::Add, index, ConstantInt::get(i64, 2), "", bb), "", bb);
+	Value *page = BinaryOperator::Create(Instruction::And, a, ConstantInt::get(i64, ~mask), "", bb);
+	Value *hit = new ICmpInst(*bb, ICmpInst::ICMP_EQ, new LoadInst(p_page, "", false, bb), page);
+	Value *addend = new LoadInst(p_addend, "", false, bb);
+
+	// bb: if (hit) goto cont; else goto miss;
+	BasicBlock *bb_head = split_basicblock(cpu, bb);
+	BasicBlock *bb_miss = create_inner_basicblock(cpu, "tlbmiss", bb);
+	BranchInst::Create(bb, bb_miss, hit, bb_head);
+
+	// miss: fill the entry, leave if there is no mapping
+	Constant *v_fault_pc = get_host_ptr(cpu, "__libcpu_fault_pc", &cpu->fault_pc, i64);
+	new StoreInst(ConstantInt::get(i64, cpu->cur_pc), v_fault_pc, bb_miss);
+	std::vector<Value *> args;
+	args.push_back(get_host_ptr(cpu, "__libcpu_cpu", cpu, cpu->dl->getIntPtrType(_CTX())));
+	args.push_back(a);
+	args.push_back(ConstantInt::get(getIntegerType(32), write));
+	Value *filled = CallInst::Create(get_fill_func(cpu), args, "", bb_miss);
+	Value *fault = new ICmpInst(*bb_miss, ICmpInst::ICMP_EQ, filled, ConstantInt::get(i64, TLB_FAULT));
+	BranchInst::Create(cpu->bb_memfault, bb, fault, bb_miss);
+
+	// cont: physical address
+	PHINode *phi = PHINode::Create(i64, 2, "", bb);
+	phi->addIncoming(addend, bb_head);
+	phi->addIncoming(filled, bb_miss);
+	return BinaryOperator::Create(Instruction::Add, a, phi, "", bb);
+}
@@ -0,0 +1,6 @@
+void softmmu_init(cpu_t *cpu);
+void softmmu_free(cpu_t *cpu);
+void softmmu_flush(cpu_t *cpu);
+void softmmu_flush_page(cpu_t *cpu, addr_t vaddr);
+uint64_t softmmu_fill(cpu_t *cpu, uint64_t vaddr, uint32_t write);
+Value *softmmu_translate(cpu_t *cpu, Value *a, bool write, BasicBlock *bb);
@@ -1,3 +1,5 @@
+#include <chrono>
+
 #include "libcpu.h"
 #if HAVE_SYS_RESOURCE_H
 #include <sys/resource.h>
@@ -23,3 +25,13 @@ void update_timing(cpu_t *cpu, int index, bool start)
 	else
 		cpu->timer_total[index] += usec - cpu->timer_start[index];
 }
+
+/* wall clock time, usable from any thread; 0 unless profiling */
+uint64_t get_wall_usec(cpu_t *cpu)
+{
+	if ((cpu->flags_debug & CPU_DEBUG_PROFILE) == 0)
+		return 0;
+
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
@@ -1 +1,2 @@
 void update_timing(cpu_t *cpu, int index, bool start);
+uint64_t get_wall_usec(cpu_t *cpu);
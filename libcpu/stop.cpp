@@ -0,0 +1,57 @@
+/*
+ * libcpu: stop.cpp
+ *
+ * Stop requests. cpu_request_exit only sets a flag, so it can be
+ * called from other threads and from signal handlers. Translated code
+ * polls it on back edges and before dispatching indirect branches and
+ * returns, which every loop of guest code passes, and returns to
+ * cpu_run with the registers written back and the pc at the next
+ * instruction. cpu_run returns JIT_RETURN_EXIT, and the outermost
+ * run clears the flag.
+ */
+
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Instructions.h"
+
+#include "libcpu.h"
+#include "libcpu_llvm.h"
+#include "basicblock.h"
+#include "objcache.h"
+#include "stop.h"
+
+static Value *
+stop_emit_requested(cpu_t *cpu, BasicBlock *bb)
+{
+	Constant *v_request = get_host_ptr(cpu, "__libcpu_exit_request", (void *)&cpu->exit_request, getIntegerType(8));
+	Value *request = new LoadInst(v_request, "", true, bb);
+	return new ICmpInst(*bb, ICmpInst::ICMP_NE, request, ConstantInt::get(getIntegerType(8), 0));
+}
+
+/*
+ * Back edge to new_pc: leave the unit if a stop has been requested,
+ * otherwise continue at bb_target.
+ */
+BasicBlock *
+stop_emit_check(cpu_t *cpu, addr_t new_pc, BasicBlock *bb_target, BasicBlock *bb_ret)
+{
+	BasicBlock *bb_check = create_basicblock(cpu, new_pc, cpu->cur_func, BB_TYPE_STOP);
+	BasicBlock *bb_exit = create_basicblock(cpu, new_pc, cpu->cur_func, BB_TYPE_EXTERNAL);
+
+	BranchInst::Create(bb_exit, bb_target, stop_emit_requested(cpu, bb_check), bb_check);
+	emit_store_pc_return(cpu, bb_exit, new_pc, bb_ret);
+	return bb_check;
+}
+
+/*
+ * In front of the dispatch switch: the indirect branch or return has
+ * stored the pc already, just leave.
+ */
+BasicBlock *
+stop_emit_dispatch_check(cpu_t *cpu, BasicBlock *bb_dispatch, BasicBlock *bb_ret)
+{
+	BasicBlock *bb_check = BasicBlock::Create(_CTX(), "dispatch_stop", cpu->cur_func, bb_dispatch);
+
+	BranchInst::Create(bb_ret, bb_dispatch, stop_emit_requested(cpu, bb_check), bb_check);
+	return bb_check;
+}
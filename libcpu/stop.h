@@ -0,0 +1,2 @@
+BasicBlock *stop_emit_check(cpu_t *cpu, addr_t new_pc, BasicBlock *bb_target, BasicBlock *bb_ret);
+BasicBlock *stop_emit_dispatch_check(cpu_t *cpu, BasicBlock *bb_dispatch, BasicBlock *bb_ret);
@@ -7,41 +7,62 @@
  * (conditional, ...) and code flow information (branch
  * target, ...)
  */
+#include <assert.h>
+#include <inttypes.h>
+#include <algorithm>
+
 #include "libcpu.h"
 #include "tag.h"
+#include "tagcache.h"
 #include "sha1.h"
 
 /*
- * TODO: on architectures with constant instruction sizes,
- * this shouldn't waste extra tag data for every byte of
- * code memory, but have one tag per instruction location.
+ * There is one tag per instruction slot: every byte on architectures
+ * with variable length instructions, every instr_align bytes on the
+ * others. TAG_CODE and the basic block starts are also kept in
+ * bitmaps, which can be tested and scanned a word at a time.
+ *
+ * The slots are grouped in pages that are only allocated when a tag
+ * is set in them, and the pages hang off a radix tree as deep as the
+ * code area needs. Memory use follows the code found, not the size
+ * of the code area.
  */
 
-#ifdef _WIN32
-#define MAX_PATH 260
-extern "C" __declspec(dllimport) uint32_t __stdcall GetTempPathA(uint32_t nBufferLength, char *lpBuffer);
-#endif
+#define TAG_NODE_BITS	10	/* 1024 children per tree node */
+#define TAG_NODE_SIZE	(1 << TAG_NODE_BITS)
 
-static const char *
-get_temp_dir()
-{
-#ifdef _WIN32
-	static char pathname[MAX_PATH];
-	if (GetTempPathA(sizeof(pathname), pathname))
-		return pathname;
-#endif
-	return "/tmp/";
-}
+/* allocated zeroed, so every slot starts out as TAG_UNKNOWN */
+typedef struct tag_page {
+	tag_t tag[TAG_PAGE_SLOTS];
+	uint64_t code_map[TAG_PAGE_SLOTS / 64];		/* TAG_CODE */
+	uint64_t start_map[TAG_PAGE_SLOTS / 64];	/* basic block starts */
+} tag_page_t;
+
+/* children are nodes, or pages in the lowest level */
+typedef struct tag_node {
+	void *child[TAG_NODE_SIZE];
+} tag_node_t;
 
 static void
 init_tagging(cpu_t *cpu)
 {
-	addr_t nitems, i;
+	addr_t nitems;
+	uint32_t align = cpu->info.instr_align != 0 ? cpu->info.instr_align : 1;
 
-	nitems = cpu->code_end - cpu->code_start;
-	cpu->tag = (tag_t*)malloc(nitems * sizeof(tag_t));
-	for (i = 0; i < nitems; i++)
-		cpu->tag[i] = TAG_UNKNOWN;
+	cpu->tag_shift = 0;
+	while ((1U << cpu->tag_shift) < align)
+		cpu->tag_shift++;
+	nitems = (cpu->code_end - cpu->code_start + align - 1) >> cpu->tag_shift;
+	cpu->tag_slots = nitems;
+
+	/* enough levels to reach every page */
+	addr_t last_page = nitems != 0 ? (nitems - 1) >> TAG_PAGE_BITS : 0;
+	cpu->tag_levels = 1;
+	while (cpu->tag_levels * TAG_NODE_BITS < 64 && (last_page >> (cpu->tag_levels * TAG_NODE_BITS)) != 0)
+		cpu->tag_levels++;
+	cpu->tag_root = (tag_node_t*)calloc(1, sizeof(tag_node_t));
+	cpu->tag_last_page = NULL;
+	cpu->tag_pages = 0;
 
 	if (!(cpu->flags_codegen & CPU_CODEGEN_TAG_LIMIT)) {
 		/* calculate hash of code */
@@ -49,36 +70,12 @@ init_tagging(cpu_t *cpu)
 		SHA1Init(&ctx);
 		SHA1Update(&ctx, &cpu->RAM[cpu->code_start], cpu->code_end - cpu->code_start);
 		SHA1Final(cpu->code_digest, &ctx);
-		char ascii_digest[256];
-		char cache_fn[256];
-		ascii_digest[0] = 0;
-		int j; 
-		for (j=0; j<20; j++)
-			sprintf(ascii_digest+strlen(ascii_digest), "%02x", cpu->code_digest[j]);
-		LOG("Code Digest: %s\n", ascii_digest);
-		sprintf(cache_fn, "%slibcpu-%s.entries", get_temp_dir(), ascii_digest);
-		
-		cpu->file_entries = NULL;
-		
-		FILE *f;
-		if ((f = fopen(cache_fn, "r"))) {
-			LOG("info: entry cache found.\n");
-			while(!feof(f)) {
-				addr_t entry = 0;
-				for (i = 0; i < 4; i++) {
-					entry |= fgetc(f) << (i*8);
-				}
-				tag_start(cpu, entry);
-			}
-			fclose(f);
-		} else {
-			LOG("info: entry cache NOT found.\n");
-		}
-		
-		if (!(cpu->file_entries = fopen(cache_fn, "a"))) {
-			printf("error appending to cache file!\n");
-			exit(1);
-		}
+
+		/* a previous run may have tagged this code already */
+		if (tagcache_load(cpu))
+			LOG("info: tag cache found.\n");
+		else
+			LOG("info: tag cache NOT found.\n");
 	}
 }
 
@@ -88,19 +85,174 @@ is_inside_code_area(cpu_t *cpu, addr_t a)
 	return a >= cpu->code_start && a < cpu->code_end;
 }
 
+static inline bool
+is_bb_start(tag_t tag)
+{
+	return (tag & TAG_BB_START) && (tag & TAG_CODE);
+}
+
+/* slot of address a, false if no instruction can start there */
+static inline bool
+get_slot(cpu_t *cpu, addr_t a, addr_t *slot)
+{
+	if (!is_inside_code_area(cpu, a))
+		return false;
+
+	addr_t offset = a - cpu->code_start;
+	if (offset & ((1U << cpu->tag_shift) - 1))
+		return false;
+	*slot = offset >> cpu->tag_shift;
+	return true;
+}
+
+/*
+ * The page holding slot, or NULL if nothing has been tagged in it yet
+ * and alloc is false. The page used last is remembered, as tagging
+ * and translation mostly walk through code sequentially.
+ */
+static tag_page_t *
+get_page(cpu_t *cpu, addr_t slot, bool alloc)
+{
+	addr_t index = slot >> TAG_PAGE_BITS;
+
+	if (cpu->tag_last_page != NULL && cpu->tag_last_index == index)
+		return cpu->tag_last_page;
+
+	tag_node_t *node = cpu->tag_root;
+	for (uint32_t level = cpu->tag_levels - 1; ; level--) {
+		void **child = &node->child[(index >> (level * TAG_NODE_BITS)) & (TAG_NODE_SIZE - 1)];
+		if (*child == NULL) {
+			if (!alloc)
+				return NULL;
+			if (level == 0) {
+				*child = calloc(1, sizeof(tag_page_t));
+				cpu->tag_pages++;
+			} else
+				*child = calloc(1, sizeof(tag_node_t));
+			assert(*child != NULL);
+		}
+		if (level == 0) {
+			cpu->tag_last_page = (tag_page_t *)*child;
+			cpu->tag_last_index = index;
+			return cpu->tag_last_page;
+		}
+		node = (tag_node_t *)*child;
+	}
+}
+
+static inline bool
+test_bit(const uint64_t *map, unsigned n)
+{
+	return (map[n / 64] >> (n % 64)) & 1;
+}
+
+static inline void
+set_bit(uint64_t *map, unsigned n, bool v)
+{
+	if (v)
+		map[n / 64] |= 1ULL << (n % 64);
+	else
+		map[n / 64] &= ~(1ULL << (n % 64));
+}
+
+static inline unsigned
+ctz64(uint64_t v)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(v);
+#else
+	unsigned n = 0;
+	while (!(v & 1)) {
+		v >>= 1;
+		n++;
+	}
+	return n;
+#endif
+}
+
+static inline void
+update_maps(tag_page_t *page, unsigned n)
+{
+	tag_t tag = page->tag[n];
+	set_bit(page->code_map, n, (tag & TAG_CODE) != 0);
+	set_bit(page->start_map, n, is_bb_start(tag));
+}
+
+/*
+ * Tags only ever change through or_tag() and clear_tag(), so this is
+ * where new basic blocks are found: a location becomes a block start
+ * once it has both TAG_CODE and a TAG_BB_START flag, and needs to be
+ * translated again when it loses TAG_TRANSLATED.
+ */
 void
 or_tag(cpu_t *cpu, addr_t a, tag_t t)
 {
-	if (is_inside_code_area(cpu, a))
-		cpu->tag[a - cpu->code_start] |= t;
+	addr_t slot;
+
+	if (get_slot(cpu, a, &slot)) {
+		tag_page_t *page = get_page(cpu, slot, true);
+		unsigned n = slot & (TAG_PAGE_SLOTS - 1);
+		tag_t *tag = &page->tag[n];
+		bool was_start = is_bb_start(*tag);
+		*tag |= t;
+		update_maps(page, n);
+		if (!was_start && is_bb_start(*tag))
+			cpu->bb_worklist.push_back(a);
+	}
+}
+
+void
+clear_tag(cpu_t *cpu, addr_t a, tag_t t)
+{
+	addr_t slot;
+
+	tag_page_t *page;
+
+	if (get_slot(cpu, a, &slot) && (page = get_page(cpu, slot, false)) != NULL) {
+		unsigned n = slot & (TAG_PAGE_SLOTS - 1);
+		tag_t *tag = &page->tag[n];
+		if ((t & TAG_TRANSLATED) && (*tag & TAG_TRANSLATED) && is_bb_start(*tag))
+			cpu->bb_worklist.push_back(a);
+		*tag &= ~t;
+		update_maps(page, n);
+	}
+}
+
+/*
+ * Copy the basic blocks tagged since the last tag_take_new_bbs() that
+ * still need translating to bbs, in address order.
+ */
+void
+tag_new_bbs(cpu_t *cpu, std::vector<addr_t> &bbs)
+{
+	std::vector<addr_t> &list = cpu->bb_worklist;
+
+	std::sort(list.begin(), list.end());
+	list.erase(std::unique(list.begin(), list.end()), list.end());
+	for (std::vector<addr_t>::const_iterator it = list.begin(); it != list.end(); it++) {
+		tag_t tag = get_tag(cpu, *it);
+		if (is_bb_start(tag) && !(tag & TAG_TRANSLATED))
+			bbs.push_back(*it);
+	}
+}
+
+/* like tag_new_bbs(), but the blocks are taken off the worklist */
+void
+tag_take_new_bbs(cpu_t *cpu, std::vector<addr_t> &bbs)
+{
+	tag_new_bbs(cpu, bbs);
+	cpu->bb_worklist.clear();
 }
 
 /* access functions */
 tag_t
 get_tag(cpu_t *cpu, addr_t a)
 {
-	if (is_inside_code_area(cpu, a))
-		return cpu->tag[a - cpu->code_start];
+	addr_t slot;
+	tag_page_t *page;
+
+	if (get_slot(cpu, a, &slot) && (page = get_page(cpu, slot, false)) != NULL)
+		return page->tag[slot & (TAG_PAGE_SLOTS - 1)];
 	else
 		return TAG_UNKNOWN;
 }
@@ -108,15 +260,166 @@ get_tag(cpu_t *cpu, addr_t a)
 bool
 is_code(cpu_t *cpu, addr_t a)
 {
-	return !!(get_tag(cpu, a) & TAG_CODE);
+	addr_t slot;
+	tag_page_t *page;
+
+	return get_slot(cpu, a, &slot) && (page = get_page(cpu, slot, false)) != NULL &&
+		test_bit(page->code_map, slot & (TAG_PAGE_SLOTS - 1));
+}
+
+bool
+tag_is_bb_start(cpu_t *cpu, addr_t a)
+{
+	addr_t slot;
+	tag_page_t *page;
+
+	return get_slot(cpu, a, &slot) && (page = get_page(cpu, slot, false)) != NULL &&
+		test_bit(page->start_map, slot & (TAG_PAGE_SLOTS - 1));
+}
+
+/* the first block start in page index at or after slot from */
+static bool
+next_start_in_page(tag_page_t *page, addr_t index, addr_t from, addr_t *slot)
+{
+	addr_t first = index << TAG_PAGE_BITS;
+	unsigned n = from > first ? (unsigned)(from - first) : 0;
+	unsigned w = n / 64;
+	uint64_t bits = page->start_map[w] & (~0ULL << (n % 64));
+
+	while (bits == 0) {
+		if (++w == TAG_PAGE_SLOTS / 64)
+			return false;
+		bits = page->start_map[w];
+	}
+	*slot = first + w * 64 + ctz64(bits);
+	return true;
+}
+
+/* same in the pages below node, the first of which is base; skips what is not allocated */
+static bool
+next_start_in_node(tag_node_t *node, uint32_t level, addr_t base, addr_t from, addr_t *slot)
+{
+	addr_t span = (addr_t)1 << (level * TAG_NODE_BITS);	/* pages per child */
+	addr_t from_index = from >> TAG_PAGE_BITS;
+	unsigned i = from_index > base ? (unsigned)((from_index - base) / span) : 0;
+
+	for (; i < TAG_NODE_SIZE; i++) {
+		if (node->child[i] == NULL)
+			continue;
+		addr_t child_base = base + i * span;
+		if (level == 0) {
+			if (next_start_in_page((tag_page_t *)node->child[i], child_base, from, slot))
+				return true;
+		} else if (next_start_in_node((tag_node_t *)node->child[i], level - 1, child_base, from, slot))
+			return true;
+	}
+	return false;
+}
+
+/* the first basic block start at or after a, code_end if there is none */
+addr_t
+tag_next_bb_start(cpu_t *cpu, addr_t a)
+{
+	addr_t slot;
+
+	if (a < cpu->code_start)
+		a = cpu->code_start;
+	if (a >= cpu->code_end || cpu->tag_root == NULL)
+		return cpu->code_end;
+
+	addr_t align = (addr_t)1 << cpu->tag_shift;
+	addr_t from = (a - cpu->code_start + align - 1) >> cpu->tag_shift;
+	if (!next_start_in_node(cpu->tag_root, cpu->tag_levels - 1, 0, from, &slot))
+		return cpu->code_end;
+	return cpu->code_start + (slot << cpu->tag_shift);
+}
+
+static void
+walk_node(tag_node_t *node, uint32_t level, addr_t base, tag_page_fn_t fn, void *arg)
+{
+	addr_t span = (addr_t)1 << (level * TAG_NODE_BITS);
+
+	for (unsigned i = 0; i < TAG_NODE_SIZE; i++) {
+		if (node->child[i] == NULL)
+			continue;
+		addr_t child_base = base + i * span;
+		if (level == 0)
+			fn(arg, child_base, ((tag_page_t *)node->child[i])->tag);
+		else
+			walk_node((tag_node_t *)node->child[i], level - 1, child_base, fn, arg);
+	}
+}
+
+/* call fn for every allocated page, in address order */
+void
+tag_walk_pages(cpu_t *cpu, tag_page_fn_t fn, void *arg)
+{
+	if (cpu->tag_root != NULL)
+		walk_node(cpu->tag_root, cpu->tag_levels - 1, 0, fn, arg);
+}
+
+/*
+ * Set the tags of page index to a copy of tags, less TAG_TRANSLATED,
+ * as tag_walk_pages() passed them in an earlier run.
+ */
+void
+tag_load_page(cpu_t *cpu, addr_t index, const tag_t *tags)
+{
+	addr_t first = index << TAG_PAGE_BITS;
+
+	if (first >= cpu->tag_slots)
+		return;
+
+	tag_page_t *page = get_page(cpu, first, true);
+	for (unsigned n = 0; n < TAG_PAGE_SLOTS; n++) {
+		page->tag[n] = tags[n] & ~TAG_TRANSLATED;
+		update_maps(page, n);
+		if (is_bb_start(page->tag[n]))
+			cpu->bb_worklist.push_back(cpu->code_start + ((first + n) << cpu->tag_shift));
+	}
+}
+
+static void
+free_node(tag_node_t *node, uint32_t level)
+{
+	for (unsigned i = 0; i < TAG_NODE_SIZE; i++) {
+		if (node->child[i] != NULL && level != 0)
+			free_node((tag_node_t *)node->child[i], level - 1);
+		else
+			free(node->child[i]);
+	}
+	free(node);
+}
+
+void
+free_tagging(cpu_t *cpu)
+{
+	if (cpu->tag_root != NULL) {
+		LOG("tags: %" PRIu64 " pages\n", (uint64_t)cpu->tag_pages);
+		free_node(cpu->tag_root, cpu->tag_levels - 1);
+	}
+	cpu->tag_root = NULL;
+	cpu->tag_last_page = NULL;
 }
 
 extern void disasm_instr(cpu_t *cpu, addr_t pc);
 
+/* a code sequence still to be tagged, level is the DFS depth */
+typedef struct tag_frame {
+	addr_t pc;
+	int level;
+} tag_frame_t;
+
+/*
+ * Tag the code sequence at pc until it ends or reaches a call or
+ * branch target. In that case the targets, and the rest of the
+ * sequence below them, are pushed on stack: the targets are tagged
+ * first, in the same depth first order as the recursion we used to
+ * have, so the result is the same even with CPU_CODEGEN_TAG_LIMIT.
+ */
 static void
-tag_recursive(cpu_t *cpu, addr_t pc, int level)
+tag_sequence(cpu_t *cpu, addr_t pc, int level, std::vector<tag_frame_t> &stack)
 {
-	int bytes;
 	tag_t tag;
 	addr_t new_pc, next_pc;
 
@@ -125,6 +428,10 @@ tag_recursive(cpu_t *cpu, addr_t pc, int level)
 		return;
 
 	for(;;) {
+		addr_t targets[3];
+		int ntargets = 0;
+		bool cont = true;
+
 		if (!is_inside_code_area(cpu, pc))
 			return;
 		if (is_code(cpu, pc))	/* we have already been here, ignore */
@@ -135,7 +442,7 @@ tag_recursive(cpu_t *cpu, addr_t pc, int level)
 			disasm_instr(cpu, pc);
 		}
 
-		bytes = cpu->f.tag_instr(cpu, pc, &tag, &new_pc, &next_pc);
+		cpu->f.tag_instr(cpu, pc, &tag, &new_pc, &next_pc);
 		or_tag(cpu, pc, tag | TAG_CODE);
 
 		if (tag & TAG_CONDITIONAL)
@@ -163,7 +470,7 @@ tag_recursive(cpu_t *cpu, addr_t pc, int level)
 				addr_t next_pc2, dummy2;
 				next_pc2 = next_pc + cpu->f.tag_instr(cpu, next_pc, &dummy1, &dummy2, &dummy2);
 				or_tag(cpu, next_pc2, TAG_AFTER_TRAP);
-				tag_recursive(cpu, next_pc2, level+1);
+				targets[ntargets++] = next_pc2;
 			}
 		}
 
@@ -171,23 +478,47 @@ tag_recursive(cpu_t *cpu, addr_t pc, int level)
 			/* tag subroutine, then continue with next instruction */
 			or_tag(cpu, new_pc, TAG_SUBROUTINE);
 			or_tag(cpu, next_pc, TAG_AFTER_CALL);
-			tag_recursive(cpu, new_pc, level+1);
+			targets[ntargets++] = new_pc;
 		}
 
 		if (tag & TAG_BRANCH) {
 			or_tag(cpu, new_pc, TAG_BRANCH_TARGET);
-			tag_recursive(cpu, new_pc, level+1);
+			targets[ntargets++] = new_pc;
 			if (!(tag & TAG_CONDITIONAL))
-				return;
+				cont = false;
 		}
 
 		if (tag & TAG_RET)	/* execution ends here, the follwing location is not reached */
+			cont = false;
+
+		if (ntargets != 0) {
+			if (cont)
+				stack.push_back({ next_pc, level });
+			while (ntargets != 0)
+				stack.push_back({ targets[--ntargets], level + 1 });
+			return;
+		}
+		if (!cont)
 			return;
 
 		pc = next_pc;
 	}
 }
 
+/* tag all code reachable from pc, with an explicit stack */
+static void
+tag_reachable(cpu_t *cpu, addr_t pc)
+{
+	std::vector<tag_frame_t> stack;
+
+	stack.push_back({ pc, 0 });
+	while (!stack.empty()) {
+		tag_frame_t frame = stack.back();
+		stack.pop_back();
+		tag_sequence(cpu, frame.pc, frame.level, stack);
+	}
+}
+
 void
 tag_start(cpu_t *cpu, addr_t pc)
 {
@@ -198,20 +529,16 @@ tag_start(cpu_t *cpu, addr_t pc)
 		return;
 
 	/* initialize data structure on demand */
-	if (!cpu->tag)
+	if (!cpu->tag_root)
 		init_tagging(cpu);
 
 	LOG("starting tagging at $%02llx\n", (unsigned long long)pc);
 
-	if (!(cpu->flags_codegen & CPU_CODEGEN_TAG_LIMIT)) {
-		int i;
-		if (cpu->file_entries) {
-			for (i = 0; i < 4; i++)
-				fputc((pc >> (i*8))&0xFF, cpu->file_entries);
-			fflush(cpu->file_entries);
-		}
-	}
-
+	bool known = (get_tag(cpu, pc) & TAG_ENTRY) != 0;
 	or_tag(cpu, pc, TAG_ENTRY); /* client wants to enter the guest code here */
-	tag_recursive(cpu, pc, 0);
+	tag_reachable(cpu, pc);
+
+	if (!(cpu->flags_codegen & CPU_CODEGEN_TAG_LIMIT) && !known &&
+			(get_tag(cpu, pc) & TAG_ENTRY))
+		tagcache_add_entry(cpu, pc);
 }
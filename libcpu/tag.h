@@ -25,11 +25,33 @@
 
 #define TAG_UNKNOWN      0	/* unused (or not yet discovered) code or data */
 
+/* tags are stored in pages of this many instruction slots */
+#define TAG_PAGE_BITS	12
+#define TAG_PAGE_SLOTS	(1 << TAG_PAGE_BITS)
+
+typedef void (*tag_page_fn_t)(void *arg, addr_t index, const tag_t *tags);
+
+/* a basic block starts at tagged code with any of these */
+#define TAG_BB_START	(TAG_BRANCH_TARGET |	/* someone jumps/branches here */ \
+						 TAG_SUBROUTINE |		/* someone calls this */ \
+						 TAG_AFTER_CALL |		/* instruction after a call */ \
+						 TAG_AFTER_COND |		/* instruction after a branch */ \
+						 TAG_AFTER_TRAP |		/* instruction after a trap */ \
+						 TAG_ENTRY)			/* client wants to enter guest code here */
+
 tag_t get_tag(cpu_t *cpu, addr_t a);
 void or_tag(cpu_t *cpu, addr_t a, tag_t t);
+void clear_tag(cpu_t *cpu, addr_t a, tag_t t);
 bool is_inside_code_area(cpu_t *cpu, addr_t a);
 bool is_code(cpu_t *cpu, addr_t a);
+bool tag_is_bb_start(cpu_t *cpu, addr_t a);
+addr_t tag_next_bb_start(cpu_t *cpu, addr_t a);
+void tag_walk_pages(cpu_t *cpu, tag_page_fn_t fn, void *arg);
+void tag_load_page(cpu_t *cpu, addr_t index, const tag_t *tags);
+void free_tagging(cpu_t *cpu);
 void tag_start(cpu_t *cpu, addr_t pc);
+void tag_new_bbs(cpu_t *cpu, std::vector<addr_t> &bbs);
+void tag_take_new_bbs(cpu_t *cpu, std::vector<addr_t> &bbs);
 
 /*
  * NEW_PC_NONE states that the destination of a call is unknown.
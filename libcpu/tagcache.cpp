@@ -0,0 +1,239 @@
+/*
+ * libcpu: tagcache.cpp
+ *
+ * Tag cache. Without CPU_CODEGEN_TAG_LIMIT, the entries the client
+ * gave us and the tags found from them are kept in the cache
+ * directory (see cachedir.cpp), keyed by the digest of the code. A later run of the
+ * same code maps the file and takes the tags from it, so it doesn't
+ * need to tag again.
+ *
+ * The file is a header, the entries and the allocated tag pages. It
+ * is written as a whole, to a temporary file that is then renamed,
+ * once enough new entries have been seen and when the cpu is freed.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+#include <string>
+
+#include "libcpu.h"
+#include "tag.h"
+#include "tagcache.h"
+#include "cachedir.h"
+#if HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define TAGCACHE_MAGIC		0x4754504c	/* "LPTG" */
+#define TAGCACHE_VERSION	1
+
+/* write the file after this many new entries */
+#define TAGCACHE_BATCH		64
+
+typedef struct tagcache_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t arch;			/* these decide what tagging finds */
+	uint32_t arch_flags;
+	uint32_t flags_hint;
+	uint32_t tag_shift;
+	uint32_t page_slots;
+	uint32_t tag_size;
+	uint64_t code_start;
+	uint64_t code_end;
+	uint64_t entry_count;	/* followed by the entries, 64 bits each */
+	uint64_t page_count;	/* then by the pages: index, tags */
+} tagcache_header_t;
+
+/* "" if there is no cache directory */
+static std::string
+tagcache_file_name(cpu_t *cpu)
+{
+	const std::string &dir = cachedir_get(cpu);
+	char ascii_digest[2 * sizeof(cpu->code_digest) + 1];
+
+	if (dir.empty())
+		return "";
+	for (size_t i = 0; i < sizeof(cpu->code_digest); i++)
+		sprintf(ascii_digest + 2 * i, "%02x", cpu->code_digest[i]);
+	return dir + ascii_digest + ".tags";
+}
+
+static void
+tagcache_init_header(cpu_t *cpu, tagcache_header_t *hdr)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = TAGCACHE_MAGIC;
+	hdr->version = TAGCACHE_VERSION;
+	hdr->arch = cpu->info.type;
+	hdr->arch_flags = cpu->info.arch_flags;
+	hdr->flags_hint = cpu->flags_hint;
+	hdr->tag_shift = cpu->tag_shift;
+	hdr->page_slots = TAG_PAGE_SLOTS;
+	hdr->tag_size = sizeof(tag_t);
+	hdr->code_start = cpu->code_start;
+	hdr->code_end = cpu->code_end;
+}
+
+static bool
+tagcache_parse(cpu_t *cpu, const uint8_t *data, size_t size)
+{
+	tagcache_header_t hdr, expected;
+	const size_t page_size = sizeof(uint64_t) + TAG_PAGE_SLOTS * sizeof(tag_t);
+
+	if (size < sizeof(hdr))
+		return false;
+	memcpy(&hdr, data, sizeof(hdr));
+	tagcache_init_header(cpu, &expected);
+	expected.entry_count = hdr.entry_count;
+	expected.page_count = hdr.page_count;
+	if (memcmp(&hdr, &expected, sizeof(hdr)) != 0) {
+		LOG("info: ignoring stale tag cache\n");
+		return false;
+	}
+	if (hdr.entry_count > (size - sizeof(hdr)) / sizeof(uint64_t) ||
+			hdr.page_count != (size - sizeof(hdr) - hdr.entry_count * sizeof(uint64_t)) / page_size) {
+		LOG("info: ignoring truncated tag cache\n");
+		return false;
+	}
+
+	const uint8_t *p = data + sizeof(hdr);
+	for (uint64_t i = 0; i < hdr.entry_count; i++, p += sizeof(uint64_t)) {
+		uint64_t entry;
+		memcpy(&entry, p, sizeof(entry));
+		cpu->tag_entries.push_back(entry);
+	}
+	for (uint64_t i = 0; i < hdr.page_count; i++, p += page_size) {
+		uint64_t index;
+		memcpy(&index, p, sizeof(index));
+		tag_load_page(cpu, index, (const tag_t *)(p + sizeof(index)));
+	}
+	LOG("info: %" PRIu64 " entries, %" PRIu64 " tag pages loaded\n", hdr.entry_count, hdr.page_count);
+	return true;
+}
+
+/* load the tags of an earlier run, false if there are none */
+bool
+tagcache_load(cpu_t *cpu)
+{
+	std::string fn = tagcache_file_name(cpu);
+	struct stat st;
+	bool ok = false;
+	int fd;
+
+	if (fn.empty() || (fd = cachedir_open(cpu, fn)) < 0)
+		return false;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return false;
+	}
+
+#if HAVE_SYS_MMAN_H
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data != MAP_FAILED) {
+		ok = tagcache_parse(cpu, (const uint8_t *)data, st.st_size);
+		munmap(data, st.st_size);
+	}
+#else
+	uint8_t *data = (uint8_t *)malloc(st.st_size);
+	if (data != NULL && read(fd, data, st.st_size) == st.st_size)
+		ok = tagcache_parse(cpu, data, st.st_size);
+	free(data);
+#endif
+	close(fd);
+
+	cpu->tag_unsaved = 0;
+	return ok;
+}
+
+static void
+write_page(void *arg, addr_t index, const tag_t *tags)
+{
+	FILE *f = (FILE *)arg;
+	uint64_t v = index;
+	tag_t page[TAG_PAGE_SLOTS];
+
+	/* nothing is translated in the next run */
+	for (unsigned n = 0; n < TAG_PAGE_SLOTS; n++)
+		page[n] = tags[n] & ~TAG_TRANSLATED;
+	fwrite(&v, sizeof(v), 1, f);
+	fwrite(page, sizeof(page), 1, f);
+}
+
+static void
+count_page(void *arg, addr_t index, const tag_t *tags)
+{
+	(*(uint64_t *)arg)++;
+}
+
+static void
+tagcache_save(cpu_t *cpu)
+{
+	std::string fn = tagcache_file_name(cpu);
+	/* another process may be reading the file */
+	std::string tmp_fn = fn + ".tmp" + std::to_string(getpid());
+	tagcache_header_t hdr;
+	FILE *f;
+	int fd;
+
+	if (fn.empty())
+		return;
+	if ((fd = cachedir_create(cpu, tmp_fn)) < 0 || !(f = fdopen(fd, "wb"))) {
+		LOG("error: cannot create tag cache file\n");
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	tagcache_init_header(cpu, &hdr);
+	hdr.entry_count = cpu->tag_entries.size();
+	tag_walk_pages(cpu, count_page, &hdr.page_count);
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	for (std::vector<addr_t>::const_iterator it = cpu->tag_entries.begin(); it != cpu->tag_entries.end(); it++) {
+		uint64_t entry = *it;
+		fwrite(&entry, sizeof(entry), 1, f);
+	}
+	tag_walk_pages(cpu, write_page, f);
+
+	bool ok = !ferror(f);
+	ok = (fclose(f) == 0) && ok;
+	if (!ok || rename(tmp_fn.c_str(), fn.c_str()) != 0) {
+		LOG("error: cannot write tag cache file\n");
+		remove(tmp_fn.c_str());
+		return;
+	}
+	cpu->tag_unsaved = 0;
+}
+
+/* pc is a new entry, its code has been tagged */
+void
+tagcache_add_entry(cpu_t *cpu, addr_t pc)
+{
+	cpu->tag_entries.push_back(pc);
+	cpu->tag_unsaved++;
+}
+
+/* write the cache if there are enough new entries, or any if force */
+void
+tagcache_flush(cpu_t *cpu, bool force)
+{
+	if (cpu->tag_root == NULL || cpu->tag_unsaved == 0)
+		return;
+	if (force || cpu->tag_unsaved >= TAGCACHE_BATCH)
+		tagcache_save(cpu);
+}
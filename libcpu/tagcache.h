@@ -0,0 +1,3 @@
+bool tagcache_load(cpu_t *cpu);
+void tagcache_add_entry(cpu_t *cpu, addr_t pc);
+void tagcache_flush(cpu_t *cpu, bool force);
@@ -0,0 +1,75 @@
+/*
+ * libcpu: tier.cpp
+ *
+ * Tiered compilation. New units are compiled quickly (level 0: no IR
+ * optimization, fast instruction selection) and count how many basic
+ * blocks they execute. A unit that crosses the threshold sets the hot
+ * flag, and cpu_run recompiles it at level 2 or higher.
+ *
+ * Code that may be replaced checks for newer code on its back edges
+ * and, if there is some, returns to cpu_run, which continues at the
+ * loop header in the new unit (on-stack replacement).
+ */
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Instructions.h"
+
+#include "libcpu.h"
+#include "libcpu_llvm.h"
+#include "cache.h"
+#include "objcache.h"
+#include "basicblock.h"
+#include "tier.h"
+
+bool
+tier_enabled(cpu_t *cpu)
+{
+	/* the object cache stores fully compiled units */
+	return (cpu->flags_codegen & CPU_CODEGEN_TIERED) &&
+		!(cpu->flags_debug & (CPU_DEBUG_SINGLESTEP | CPU_DEBUG_SINGLESTEP_BB)) &&
+		!objcache_enabled(cpu);
+}
+
+/*
+ * Count the execution of basic block bb of the unit being translated
+ * and raise the hot flag when the unit reaches the threshold. The
+ * threshold is fixed at translation time.
+ */
+void
+tier_emit_counter(cpu_t *cpu, BasicBlock *bb)
+{
+	std::string name = "__libcpu_blocks_" + cpu->cur_unit->name;
+	Constant *v_count = get_host_ptr(cpu, name.c_str(), cpu->cur_unit->block_count, getIntegerType(64));
+	Constant *v_hot = get_host_ptr(cpu, "__libcpu_hot", &cpu->tier_hot, getIntegerType(8));
+
+	Value *v = new LoadInst(v_count, "", false, bb);
+	v = BinaryOperator::Create(Instruction::Add, v, ConstantInt::get(getIntegerType(64), 1), "", bb);
+	new StoreInst(v, v_count, bb);
+
+	Value *hit = new ICmpInst(*bb, ICmpInst::ICMP_EQ, v, ConstantInt::get(getIntegerType(64), cpu->tier_threshold));
+	Value *hot = new LoadInst(v_hot, "", false, bb);
+	hot = BinaryOperator::Create(Instruction::Or, hot, new ZExtInst(hit, getIntegerType(8), "", bb), "", bb);
+	new StoreInst(hot, v_hot, bb);
+}
+
+/*
+ * Back edge to new_pc: leave the unit if a unit became hot or the
+ * compile threads finished one, otherwise continue at bb_target.
+ */
+BasicBlock *
+tier_emit_osr_check(cpu_t *cpu, addr_t new_pc, BasicBlock *bb_target, BasicBlock *bb_ret)
+{
+	BasicBlock *bb_check = create_basicblock(cpu, new_pc, cpu->cur_func, BB_TYPE_OSR);
+	BasicBlock *bb_exit = create_basicblock(cpu, new_pc, cpu->cur_func, BB_TYPE_EXTERNAL);
+	Constant *v_hot = get_host_ptr(cpu, "__libcpu_hot", &cpu->tier_hot, getIntegerType(8));
+	Constant *v_ready = get_host_ptr(cpu, "__libcpu_ready", (void *)&cpu->code_ready, getIntegerType(8));
+
+	Value *hot = new LoadInst(v_hot, "", true, bb_check);
+	Value *ready = new LoadInst(v_ready, "", true, bb_check);
+	Value *newer = BinaryOperator::Create(Instruction::Or, hot, ready, "", bb_check);
+	newer = new ICmpInst(*bb_check, ICmpInst::ICMP_NE, newer, ConstantInt::get(getIntegerType(8), 0));
+	BranchInst::Create(bb_exit, bb_target, newer, bb_check);
+
+	emit_store_pc_return(cpu, bb_exit, new_pc, bb_ret);
+	return bb_check;
+}
@@ -0,0 +1,3 @@
+bool tier_enabled(cpu_t *cpu);
+void tier_emit_counter(cpu_t *cpu, BasicBlock *bb);
+BasicBlock *tier_emit_osr_check(cpu_t *cpu, addr_t new_pc, BasicBlock *bb_target, BasicBlock *bb_ret);
@@ -40,8 +40,10 @@ translate_instr(cpu_t *cpu, addr_t pc, tag_t tag,
 			Value *c = cpu->f.translate_cond(cpu, pc, cur_bb);
 			BranchInst::Create(bb_cond, bb_delay, c, cur_bb);
 			// bb_cond: instr; delay; goto bb_target;
+			cpu->cur_pc = pc;
 			pc += cpu->f.translate_instr(cpu, pc, bb_cond);
 			delay_pc = pc;
+			cpu->cur_pc = pc;
 			cpu->f.translate_instr(cpu, pc, bb_cond);
 			BranchInst::Create(bb_target, bb_cond);
 			// bb_cond: delay; goto bb_next;
@@ -49,7 +51,9 @@ translate_instr(cpu_t *cpu, addr_t pc, tag_t tag,
 			BranchInst::Create(bb_next, bb_delay);
 		} else {
 			// cur_bb:  instr; delay; goto bb_target;
+			cpu->cur_pc = pc;
 			pc += cpu->f.translate_instr(cpu, pc, cur_bb);
+			cpu->cur_pc = pc;
 			cpu->f.translate_instr(cpu, pc, cur_bb);
 			BranchInst::Create(bb_target, cur_bb);
 		}
@@ -64,6 +68,7 @@ translate_instr(cpu_t *cpu, addr_t pc, tag_t tag,
 		cur_bb = bb_cond;
 	}
 
+	cpu->cur_pc = pc;
 	cpu->f.translate_instr(cpu, pc, cur_bb);
 
 	if (tag & (TAG_BRANCH | TAG_CALL | TAG_RET))
@@ -11,32 +11,52 @@
 #include "libcpu.h"
 #include "libcpu_llvm.h"
 #include "basicblock.h"
+#include "budget.h"
+#include "cache.h"
+#include "callout.h"
 #include "disasm.h"
+#include "fastmem.h"
+#include "liveness.h"
+#include "stop.h"
 #include "tag.h"
+#include "tier.h"
 #include "translate.h"
 
 
+/*
+ * Translate all tagged code that has not been translated yet, or, if
+ * bbs is given, exactly these basic blocks (to recompile a unit).
+ */
 BasicBlock *
-cpu_translate_all(cpu_t *cpu, BasicBlock *bb_ret, BasicBlock *bb_trap)
+cpu_translate_all(cpu_t *cpu, BasicBlock *bb_ret, BasicBlock *bb_trap, const std::vector<addr_t> *bbs_list)
 {
 	// find all instructions that need labels and create basic blocks for them
 	int bbs = 0;
 	addr_t pc;
-	pc = cpu->code_start;
-	while (pc < cpu->code_end) {
-		// Do not create the basic block if it is already present in some other function.
-		if (is_start_of_basicblock(cpu, pc) && !(get_tag(cpu, pc) & TAG_TRANSLATED)) {
-			create_basicblock(cpu, pc, cpu->cur_func, BB_TYPE_NORMAL);
+	if (bbs_list != NULL) {
+		for (std::vector<addr_t>::const_iterator i = bbs_list->begin(); i != bbs_list->end(); i++) {
+			create_basicblock(cpu, *i, cpu->cur_func, BB_TYPE_NORMAL);
+			bbs++;
+		}
+	} else {
+		// only what has been tagged since, not what some other function has
+		std::vector<addr_t> new_bbs;
+		tag_take_new_bbs(cpu, new_bbs);
+		for (std::vector<addr_t>::const_iterator i = new_bbs.begin(); i != new_bbs.end(); i++) {
+			create_basicblock(cpu, *i, cpu->cur_func, BB_TYPE_NORMAL);
 			bbs++;
 		}
-		pc++;
 	}
 	LOG("bbs: %d\n", bbs);
 
+	// find the flag writes nothing reads
+	liveness_compute(cpu);
+
 	// create dispatch basicblock
 	BasicBlock* bb_dispatch = BasicBlock::Create(_CTX(), "dispatch", cpu->cur_func, 0);
 	Value *v_pc = new LoadInst(cpu->ptr_PC, "", false, bb_dispatch);
 	SwitchInst* sw = SwitchInst::Create(v_pc, bb_ret, bbs, bb_dispatch);
+	BasicBlock *bb_indirect = stop_emit_dispatch_check(cpu, bb_dispatch, bb_ret);
 
 	// translate basic blocks
 	bbaddr_map &bb_addr = cpu->func_bb[cpu->cur_func];
@@ -47,15 +67,34 @@ cpu_translate_all(cpu_t *cpu, BasicBlock *bb_ret, BasicBlock *bb_trap)
 
 		tag_t tag;
 		BasicBlock *bb_target = NULL, *bb_next = NULL, *bb_cont = NULL;
+		addr_t bb_end = tag_next_bb_start(cpu, pc + 1);
 
 		// Tag the function as translated.
 		or_tag(cpu, pc, TAG_TRANSLATED);
 
 		LOG("basicblock: L%08llx\n", (unsigned long long)pc);
 
-		// Add dispatch switch case for basic block.
-		ConstantInt* c = ConstantInt::get(getIntegerType(cpu->info.address_size), pc);
-		sw->addCase(c, cur_bb);
+		// count executions to find hot units
+		if (cpu->cur_unit->tier == 0)
+			tier_emit_counter(cpu, cur_bb);
+
+		// know where we are if an access faults
+		if (cpu->fastmem != NULL)
+			fastmem_emit_pc(cpu, cur_bb, pc);
+
+		// Add dispatch switch case for basic block; cpu_run runs
+		// the callout at pc instead, if there is one.
+		if (!callout_registered(cpu, pc)) {
+			ConstantInt* c = ConstantInt::get(getIntegerType(cpu->info.address_size), pc);
+			sw->addCase(c, cur_bb);
+			cache_add_entry(cpu, pc);
+		}
+
+		// take the block's instructions off the budget
+		Value *v_budget = NULL;
+		uint32_t instrs = 0;
+		if (cpu->bb_budget != NULL)
+			v_budget = budget_emit_check(cpu, cur_bb, pc);
 
 		do {
 			tag_t dummy1;
@@ -67,34 +106,52 @@ cpu_translate_all(cpu_t *cpu, BasicBlock *bb_ret, BasicBlock *bb_trap)
 
 			/* get address of the following instruction */
 			addr_t new_pc, next_pc;
-			cpu->f.tag_instr(cpu, pc, &dummy1, &new_pc, &next_pc);
+			cpu->cur_unit->size += cpu->f.tag_instr(cpu, pc, &dummy1, &new_pc, &next_pc);
 
 			/* get target basic block */
 			if (tag & TAG_RET)
-				bb_target = bb_dispatch;
+				bb_target = bb_indirect;
 			if (tag & (TAG_CALL|TAG_BRANCH)) {
 				if (new_pc == NEW_PC_NONE) /* translate_instr() will set PC */
-					bb_target = bb_dispatch;
-				else
+					bb_target = bb_indirect;
+				else {
 					bb_target = const_cast<BasicBlock*>(lookup_basicblock(cpu, cpu->cur_func, new_pc, bb_ret, BB_TYPE_NORMAL));
+					/* loop: switch to newer code if there is some */
+					if (cpu->cur_unit->osr && new_pc <= pc)
+						bb_target = tier_emit_osr_check(cpu, new_pc, bb_target, bb_ret);
+					/* loop: leave if cpu_request_exit asks to */
+					if (new_pc <= pc)
+						bb_target = stop_emit_check(cpu, new_pc, bb_target, bb_ret);
+				}
 			}
 			/* get not-taken basic block */
 			if (tag & TAG_CONDITIONAL)
  				bb_next = const_cast<BasicBlock*>(lookup_basicblock(cpu, cpu->cur_func, next_pc, bb_ret, BB_TYPE_NORMAL));
 
+			cpu->cur_flags_dead = liveness_dead_flags(cpu, pc);
 			bb_cont = translate_instr(cpu, pc, tag, bb_target, bb_trap, bb_next, cur_bb);
+			cpu->cur_flags_dead = 0;
+			instrs++;
 
 			pc = next_pc;
-			
+			/* overlapping instructions may step over the next block */
+			if (pc > bb_end)
+				bb_end = tag_next_bb_start(cpu, pc);
+
 		} while (
 					/* new basic block starts here (and we haven't translated it yet)*/
-					(!is_start_of_basicblock(cpu, pc)) &&
+					pc != bb_end &&
 					/* end of code section */ //XXX no: this is whether it's TAG_CODE
 					is_code(cpu, pc) &&
 					/* last intruction jumped away */
-					bb_cont
+					bb_cont &&
+					/* a host function replaces the next instruction */
+					!callout_registered(cpu, pc)
 				);
 
+		if (v_budget != NULL)
+			budget_set_count(cpu, v_budget, instrs);
+
 		/* link with next basic block if there isn't a control flow instr. already */
 		if (bb_cont) {
 			BasicBlock *target = const_cast<BasicBlock*>(lookup_basicblock(cpu, cpu->cur_func, pc, bb_ret, BB_TYPE_NORMAL));
@@ -103,5 +160,5 @@ cpu_translate_all(cpu_t *cpu, BasicBlock *bb_ret, BasicBlock *bb_trap)
 		}
     }
 
-	return bb_dispatch;
+	return bb_indirect;
 }
@@ -13,6 +13,7 @@
 #include "disasm.h"
 #include "tag.h"
 #include "basicblock.h"
+#include "cache.h"
 #include "translate.h"
 
 //////////////////////////////////////////////////////////////////////
@@ -36,11 +37,12 @@ cpu_translate_singlestep(cpu_t *cpu, BasicBlock *bb_ret, BasicBlock *bb_trap)
 	addr_t next_pc, pc = cpu->f.get_pc(cpu, cpu->rf.grf);
 
 	cur_bb = BasicBlock::Create(_CTX(), "instruction", cpu->cur_func, 0);
+	cache_add_entry(cpu, pc);
 
 	if (LOGGING)
 		disasm_instr(cpu, pc);
 
-	cpu->f.tag_instr(cpu, pc, &tag, &new_pc, &next_pc);
+	cpu->cur_unit->size += cpu->f.tag_instr(cpu, pc, &tag, &new_pc, &next_pc);
 
 	/* get target basic block */
 	if ((tag & TAG_RET) || (new_pc == NEW_PC_NONE)) /* translate_instr() will set PC */
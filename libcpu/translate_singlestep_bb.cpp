@@ -6,8 +6,10 @@
  */
 #include "libcpu.h"
 #include "basicblock.h"
+#include "cache.h"
 #include "disasm.h"
 #include "tag.h"
+#include "tier.h"
 #include "translate.h"
 #include "translate_singlestep.h"
 
@@ -18,6 +20,7 @@ cpu_translate_singlestep_bb(cpu_t *cpu, BasicBlock *bb_ret, BasicBlock *bb_trap)
 	addr_t pc = entry;
 
 	BasicBlock *cur_bb = create_basicblock(cpu, pc, cpu->cur_func, BB_TYPE_NORMAL);
+	cache_add_entry(cpu, pc);
 
 	tag_t tag;
 	BasicBlock *bb_target = NULL, *bb_next = NULL, *bb_cont = NULL;
@@ -28,7 +31,7 @@ cpu_translate_singlestep_bb(cpu_t *cpu, BasicBlock *bb_ret, BasicBlock *bb_trap)
 		if (LOGGING)
 			disasm_instr(cpu, pc);
 
-		cpu->f.tag_instr(cpu, pc, &tag, &new_pc, &next_pc);
+		cpu->cur_unit->size += cpu->f.tag_instr(cpu, pc, &tag, &new_pc, &next_pc);
 
 		/* get target basic block */
 		if (tag & TAG_RET)
@@ -37,9 +40,11 @@ cpu_translate_singlestep_bb(cpu_t *cpu, BasicBlock *bb_ret, BasicBlock *bb_trap)
 			if (new_pc == NEW_PC_NONE) { /* translate_instr() will set PC */
 				bb_target = bb_ret;
 			} else {
-				if (new_pc == entry)	/* tight loop */
+				if (new_pc == entry) {	/* tight loop */
 					bb_target = cur_bb;
-				else
+					if (cpu->cur_unit->osr)
+						bb_target = tier_emit_osr_check(cpu, new_pc, bb_target, bb_ret);
+				} else
 					bb_target = create_singlestep_return_basicblock(cpu, new_pc, bb_ret);
 			}
 		}
@@ -0,0 +1,492 @@
+/*
+ * Self checks of libcpu on small 6502 programs: each one runs a few
+ * instructions and looks at the registers and RAM they leave behind.
+ * Returns non-zero if any check fails.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#ifndef _WIN32
+#include <dirent.h>
+#include <unistd.h>
+#endif
+#include <libcpu.h>
+
+#include "arch/6502/6502_interface.h"
+
+#define CHECK_ORG 0x0200
+
+static int check_failures;
+/* private cache directory of the checks, "" where there is none */
+static std::string check_dir;
+
+static void
+check(bool ok, const char *what) {
+	printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+	if (!ok)
+		check_failures++;
+}
+
+static cpu_t *
+check_cpu_new(uint32_t codegen) {
+	cpu_t *cpu = cpu_new(CPU_ARCH_6502, 0, CPU_6502_BRK_TRAP |
+		CPU_6502_XXX_TRAP | CPU_6502_V_IGNORE);
+	cpu_set_flags_codegen(cpu, codegen);
+	cpu_set_flags_debug(cpu, CPU_DEBUG_NONE);
+	if (!check_dir.empty())
+		cpu_set_cache_dir(cpu, check_dir.c_str());
+	return cpu;
+}
+
+/* keep the tag and object caches of the checks out of the user's */
+static void
+check_dir_create() {
+#ifndef _WIN32
+	char dir[] = "/tmp/libcpu-check-XXXXXX";
+	if (mkdtemp(dir) != NULL)
+		check_dir = dir;
+#endif
+}
+
+static void
+check_dir_remove() {
+#ifndef _WIN32
+	DIR *dirp;
+	struct dirent *dp;
+
+	if (check_dir.empty() || !(dirp = opendir(check_dir.c_str())))
+		return;
+	while ((dp = readdir(dirp)) != NULL) {
+		if (strcmp(dp->d_name, ".") && strcmp(dp->d_name, ".."))
+			unlink((check_dir + "/" + dp->d_name).c_str());
+	}
+	closedir(dirp);
+	rmdir(check_dir.c_str());
+#endif
+}
+
+/* put code at CHECK_ORG, into RAM the cpu has already */
+static void
+check_load(cpu_t *cpu, const uint8_t *code, size_t size) {
+	reg_6502_t *reg = (reg_6502_t*)cpu->rf.grf;
+
+	memcpy(&cpu->RAM[CHECK_ORG], code, size);
+	cpu->code_start = CHECK_ORG;
+	cpu->code_end = CHECK_ORG + size;
+	cpu->code_entry = CHECK_ORG;
+	cpu_tag(cpu, CHECK_ORG);
+	reg->pc = CHECK_ORG;
+	reg->s = 0xFF;
+}
+
+/* N and Z both set, through PLP and through the P a unit starts with */
+static void
+check_flags() {
+	static const uint8_t code[] = {
+		0xA9, 0x82,	/* LDA #$82 */
+		0x48,		/* PHA */
+		0x28,		/* PLP */
+		0x08,		/* PHP */
+		0xF0, 0x04,	/* BEQ +4 */
+		0xA9, 0xFF,	/* LDA #$FF */
+		0x85, 0x11,	/* STA $11 */
+		0x68,		/* PLA */
+		0x85, 0x10,	/* STA $10 */
+		0x00,		/* BRK */
+		0x08,		/* $020F: PHP */
+		0x68,		/* PLA */
+		0x85, 0x12,	/* STA $12 */
+		0x00		/* BRK */
+	};
+	uint8_t *RAM = (uint8_t*)calloc(65536, 1);
+	cpu_t *cpu = check_cpu_new(CPU_CODEGEN_OPTIMIZE);
+	reg_6502_t *reg = (reg_6502_t*)cpu->rf.grf;
+
+	cpu_set_ram(cpu, RAM);
+	check_load(cpu, code, sizeof(code));
+	cpu_tag(cpu, CHECK_ORG + 0x0F);
+	cpu_run(cpu, NULL);
+	check(RAM[0x11] == 0, "PLP: BEQ sees Z with N set");
+	check((RAM[0x10] & 0x82) == 0x82, "PLP/PHP: N and Z round trip");
+
+	reg->pc = CHECK_ORG + 0x0F;
+	reg->p = 0x82;
+	cpu_run(cpu, NULL);
+	check((RAM[0x12] & 0x82) == 0x82, "P on entry: N and Z round trip");
+
+	cpu_free(cpu);
+	free(RAM);
+}
+
+/* a flag heavy loop with a call, with or without flag liveness */
+static reg_6502_t
+check_liveness_run(bool liveness, uint8_t *result) {
+	static const uint8_t code[] = {
+		0xA2, 0x05,	/* LDX #$05 */
+		0xA9, 0x00,	/* LDA #$00 */
+		0x18,		/* CLC */
+		0x20, 0x20, 0x02,	/* $0205: JSR $0220 */
+		0xCA,		/* DEX */
+		0xD0, 0xFA,	/* BNE $0205 */
+		0xC9, 0x10,	/* CMP #$10 */
+		0xB0, 0x02,	/* BCS $0211 */
+		0xA0, 0x01,	/* LDY #$01 */
+		0x08,		/* $0211: PHP */
+		0x68,		/* PLA */
+		0x85, 0x10,	/* STA $10 */
+		0x00,		/* BRK */
+		0xEA, 0xEA, 0xEA, 0xEA, 0xEA,
+		0xEA, 0xEA, 0xEA, 0xEA, 0xEA,
+		0x69, 0x43,	/* $0220: ADC #$43 */
+		0x2A,		/* ROL A */
+		0x60		/* RTS */
+	};
+	uint8_t *RAM = (uint8_t*)calloc(65536, 1);
+	cpu_t *cpu = check_cpu_new(CPU_CODEGEN_OPTIMIZE);
+
+	if (!liveness)
+		cpu->f.flags_used = NULL;
+	cpu_set_ram(cpu, RAM);
+	check_load(cpu, code, sizeof(code));
+	cpu_run(cpu, NULL);
+	reg_6502_t reg = *(reg_6502_t*)cpu->rf.grf;
+	*result = RAM[0x10];
+
+	cpu_free(cpu);
+	free(RAM);
+	return reg;
+}
+
+/* dropping dead flag updates doesn't change what the guest sees */
+static void
+check_liveness() {
+	uint8_t result, expected;
+	reg_6502_t reg = check_liveness_run(true, &result);
+	reg_6502_t ref = check_liveness_run(false, &expected);
+
+	check(reg.a == ref.a && reg.x == ref.x && reg.y == ref.y && reg.s == ref.s,
+		"flag liveness: registers as with all flags");
+	check(reg.p == ref.p && result == expected, "flag liveness: P as with all flags");
+}
+
+/* a store past the RAM from cpu_alloc_ram leaves with MEMFAULT */
+static void
+check_fastmem() {
+	static const uint8_t code[] = {
+		0xA9, 0x01,	/* LDA #$01 */
+		0x85, 0x10,	/* STA $10 */
+		0xD0, 0x00,	/* BNE +0 */
+		0x8D, 0x00, 0x80,	/* $0206: STA $8000 */
+		0x00		/* BRK */
+	};
+	cpu_t *cpu = check_cpu_new(CPU_CODEGEN_OPTIMIZE);
+	uint8_t *RAM = cpu_alloc_ram(cpu, 0x1000);
+
+	if (RAM == NULL) {
+		printf("skipped: cpu_alloc_ram not supported\n");
+		cpu_free(cpu);
+		return;
+	}
+	check_load(cpu, code, sizeof(code));
+	int ret = cpu_run(cpu, NULL);
+	check(ret == JIT_RETURN_MEMFAULT, "cpu_alloc_ram: store past the RAM faults");
+	check(cpu->fault_pc == CHECK_ORG + 6, "cpu_alloc_ram: fault_pc is the faulting block");
+	check(cpu->fault_addr == 0x8000, "cpu_alloc_ram: fault_addr");
+	check(RAM[0x10] == 1, "cpu_alloc_ram: stores before the fault are done");
+	check(((reg_6502_t*)cpu->rf.grf)->a == 1, "cpu_alloc_ram: registers of the faulting block");
+
+	cpu_free(cpu);
+}
+
+/* physical page of virtual page $8000; $9000 is not mapped */
+static addr_t check_page;
+static int check_walks;
+
+static bool
+check_walk(cpu_t *cpu, addr_t vaddr, bool write, addr_t *paddr) {
+	check_walks++;
+	if ((vaddr & 0xF000) == 0x9000)
+		return false;
+	if ((vaddr & 0xF000) == 0x8000)
+		*paddr = check_page | (vaddr & 0x0FFF);
+	else
+		*paddr = vaddr;
+	return true;
+}
+
+/* loads through cpu_set_page_walk, and the TLB flushes */
+static void
+check_page_walk() {
+	static const uint8_t code[] = {
+		0xAD, 0x10, 0x80,	/* LDA $8010 */
+		0x85, 0x10,	/* STA $10 */
+		0x00,		/* BRK */
+		0xAD, 0x00, 0x90,	/* $0206: LDA $9000 */
+		0x00		/* BRK */
+	};
+	uint8_t *RAM = (uint8_t*)calloc(65536, 1);
+	cpu_t *cpu = check_cpu_new(CPU_CODEGEN_OPTIMIZE);
+	reg_6502_t *reg = (reg_6502_t*)cpu->rf.grf;
+
+	RAM[0x3010] = 0x11;
+	RAM[0x4010] = 0x22;
+	check_page = 0x3000;
+	cpu_set_ram(cpu, RAM);
+	cpu_set_page_walk(cpu, check_walk);
+	check_load(cpu, code, sizeof(code));
+	cpu_tag(cpu, CHECK_ORG + 6);
+	cpu_run(cpu, NULL);
+	check(RAM[0x10] == 0x11, "page walk: load through the mapping");
+
+	/* the guest changes its page table */
+	check_page = 0x4000;
+	check_walks = 0;
+	reg->pc = CHECK_ORG;
+	cpu_run(cpu, NULL);
+	check(RAM[0x10] == 0x11 && check_walks == 0, "page walk: the TLB keeps the old mapping");
+	cpu_tlb_flush_page(cpu, 0x8000);
+	reg->pc = CHECK_ORG;
+	cpu_run(cpu, NULL);
+	check(RAM[0x10] == 0x22, "cpu_tlb_flush_page: load through the new mapping");
+
+	check_page = 0x3000;
+	cpu_tlb_flush(cpu);
+	reg->pc = CHECK_ORG;
+	cpu_run(cpu, NULL);
+	check(RAM[0x10] == 0x11, "cpu_tlb_flush: load through the new mapping");
+
+	reg->pc = CHECK_ORG + 6;
+	int ret = cpu_run(cpu, NULL);
+	check(ret == JIT_RETURN_MEMFAULT && cpu->fault_addr == 0x9000,
+		"page walk: unmapped page faults");
+	check(cpu->fault_pc == CHECK_ORG + 6, "page walk: fault_pc is the faulting instruction");
+
+	cpu_free(cpu);
+	free(RAM);
+}
+
+/* the stack page, $0100, is at $0500 */
+static bool
+check_stack_walk(cpu_t *cpu, addr_t vaddr, bool write, addr_t *paddr) {
+	if ((vaddr & 0xFF00) == 0x0100)
+		*paddr = 0x0500 | (vaddr & 0x00FF);
+	else
+		*paddr = vaddr;
+	return true;
+}
+
+/* pushes and pulls go through the page walk like other accesses */
+static void
+check_stack() {
+	static const uint8_t code[] = {
+		0xA9, 0x42,	/* LDA #$42 */
+		0x48,		/* PHA */
+		0xA9, 0x00,	/* LDA #$00 */
+		0x68,		/* PLA */
+		0x85, 0x10,	/* STA $10 */
+		0x00		/* BRK */
+	};
+	uint8_t *RAM = (uint8_t*)calloc(65536, 1);
+	cpu_t *cpu = check_cpu_new(CPU_CODEGEN_OPTIMIZE);
+
+	cpu_set_ram(cpu, RAM);
+	cpu_set_page_walk(cpu, check_stack_walk);
+	check_load(cpu, code, sizeof(code));
+	cpu_run(cpu, NULL);
+	check(RAM[0x05FF] == 0x42 && RAM[0x01FF] == 0, "page walk: PHA stores through the mapping");
+	check(RAM[0x10] == 0x42, "page walk: PLA loads through the mapping");
+
+	cpu_free(cpu);
+	free(RAM);
+}
+
+static int check_mmio_reads;
+static addr_t check_mmio_addr;
+static uint64_t check_mmio_value;
+
+static uint64_t
+check_mmio_read(cpu_t *cpu, void *opaque, addr_t addr, uint32_t bits) {
+	check_mmio_reads++;
+	return 0x77;
+}
+
+static void
+check_mmio_write(cpu_t *cpu, void *opaque, addr_t addr, uint32_t bits, uint64_t value) {
+	check_mmio_addr = addr;
+	check_mmio_value = value;
+}
+
+/* stores to ROM are dropped, MMIO goes to the callbacks */
+static void
+check_regions() {
+	static const uint8_t code[] = {
+		0xA9, 0xAA,	/* LDA #$AA */
+		0x8D, 0x00, 0xC0,	/* STA $C000 */
+		0xA2, 0x01,	/* LDX #$01 */
+		0x9D, 0x00, 0xC0,	/* STA $C000,X */
+		0xAD, 0x00, 0xC0,	/* LDA $C000 */
+		0x85, 0x10,	/* STA $10 */
+		0xAD, 0x10, 0xD0,	/* LDA $D010 */
+		0x85, 0x11,	/* STA $11 */
+		0xA9, 0x33,	/* LDA #$33 */
+		0x8D, 0x20, 0xD0,	/* STA $D020 */
+		0x00		/* BRK */
+	};
+	static const cpu_region_callbacks_t mmio = { check_mmio_read, check_mmio_write, NULL };
+	uint8_t *RAM = (uint8_t*)calloc(65536, 1);
+	cpu_t *cpu = check_cpu_new(CPU_CODEGEN_OPTIMIZE);
+
+	RAM[0xC000] = 0x5A;
+	cpu_set_ram(cpu, RAM);
+	check(cpu_map_region(cpu, 0xC000, 0x100, CPU_REGION_ROM, NULL), "cpu_map_region: ROM");
+	check(cpu_map_region(cpu, 0xD000, 0x100, CPU_REGION_MMIO, &mmio), "cpu_map_region: MMIO");
+	check(!cpu_map_region(cpu, 0xC080, 0x100, CPU_REGION_MMIO, &mmio), "cpu_map_region: overlap fails");
+	check_load(cpu, code, sizeof(code));
+	cpu_run(cpu, NULL);
+	check(RAM[0xC000] == 0x5A && RAM[0xC001] == 0, "ROM: stores are dropped");
+	check(RAM[0x10] == 0x5A, "ROM: load");
+	check(RAM[0x11] == 0x77 && check_mmio_reads == 1, "MMIO: load calls the read callback");
+	check(check_mmio_addr == 0xD020 && check_mmio_value == 0x33, "MMIO: store calls the write callback");
+
+	cpu_free(cpu);
+	free(RAM);
+}
+
+/* run a ROM load with the ROM image loaded after mapping it, return what it loaded */
+static uint8_t
+check_rom_image(uint8_t image) {
+	static const uint8_t code[] = {
+		0xAD, 0x00, 0xC0,	/* LDA $C000 */
+		0x85, 0x10,	/* STA $10 */
+		0x00		/* BRK */
+	};
+	uint8_t *RAM = (uint8_t*)calloc(65536, 1);
+	cpu_t *cpu = check_cpu_new(CPU_CODEGEN_OPTIMIZE | CPU_CODEGEN_OBJCACHE);
+
+	cpu_set_ram(cpu, RAM);
+	cpu_map_region(cpu, 0xC000, 0x100, CPU_REGION_ROM, NULL);
+	RAM[0xC000] = image;
+	check_load(cpu, code, sizeof(code));
+	cpu_run(cpu, NULL);
+	uint8_t v = RAM[0x10];
+
+	cpu_free(cpu);
+	free(RAM);
+	return v;
+}
+
+/* cached units are keyed by the ROM contents they were translated with */
+static void
+check_rom_cache() {
+	if (check_dir.empty()) {
+		printf("skipped: no cache directory\n");
+		return;
+	}
+	check(check_rom_image(0x11) == 0x11, "object cache: ROM load");
+	check(check_rom_image(0x22) == 0x22, "object cache: another ROM image is another unit");
+}
+
+/* a loop run in small budgets gets as far as one run in one go */
+static void
+check_budget() {
+	static const uint8_t code[] = {
+		0xA2, 0x0A,	/* LDX #$0A */
+		0xA9, 0x00,	/* LDA #$00 */
+		0x18,		/* CLC */
+		0x69, 0x03,	/* $0205: ADC #$03 */
+		0xCA,		/* DEX */
+		0xD0, 0xFB,	/* BNE $0205 */
+		0x85, 0x10,	/* STA $10 */
+		0x00		/* BRK */
+	};
+	uint8_t *RAM = (uint8_t*)calloc(65536, 1);
+	cpu_t *cpu = check_cpu_new(CPU_CODEGEN_OPTIMIZE | CPU_CODEGEN_BUDGET);
+	int ret, runs = 0;
+
+	cpu_set_ram(cpu, RAM);
+	check_load(cpu, code, sizeof(code));
+	cpu_run(cpu, NULL);
+	uint8_t expected = RAM[0x10];
+	check(expected == 30, "cpu_run: loop result");
+
+	RAM[0x10] = 0;
+	check_load(cpu, code, sizeof(code));
+	do
+		ret = cpu_run_budget(cpu, 5, NULL);
+	while (ret == JIT_RETURN_BUDGET && ++runs < 100);
+	check(runs > 0, "cpu_run_budget: returns JIT_RETURN_BUDGET");
+	check(ret == JIT_RETURN_TRAP && RAM[0x10] == expected, "cpu_run_budget: resuming gets the same result");
+
+	cpu_free(cpu);
+	free(RAM);
+}
+
+/* MMIO writes ask for a stop while this is set */
+static bool check_stop;
+
+static void
+check_stop_write(cpu_t *cpu, void *opaque, addr_t addr, uint32_t bits, uint64_t value) {
+	if (check_stop)
+		cpu_request_exit(cpu);
+}
+
+/* stop requests from a callback, and what becomes of them */
+static void
+check_request_exit() {
+	static const uint8_t code[] = {
+		0xE6, 0x10,	/* INC $10 */
+		0x8D, 0x00, 0xD0,	/* STA $D000 */
+		0x4C, 0x00, 0x02,	/* JMP $0200 */
+		0x8D, 0x00, 0xD0,	/* $0208: STA $D000 */
+		0x00		/* BRK */
+	};
+	static const cpu_region_callbacks_t mmio = { NULL, check_stop_write, NULL };
+	uint8_t *RAM = (uint8_t*)calloc(65536, 1);
+	cpu_t *cpu = check_cpu_new(CPU_CODEGEN_OPTIMIZE | CPU_CODEGEN_BUDGET);
+	reg_6502_t *reg = (reg_6502_t*)cpu->rf.grf;
+
+	cpu_set_ram(cpu, RAM);
+	cpu_map_region(cpu, 0xD000, 0x100, CPU_REGION_MMIO, &mmio);
+	check_load(cpu, code, sizeof(code));
+	cpu_tag(cpu, CHECK_ORG + 8);
+	check_stop = true;
+	int ret = cpu_run(cpu, NULL);
+	check(ret == JIT_RETURN_EXIT, "cpu_request_exit: the loop returns JIT_RETURN_EXIT");
+	check(reg->pc == CHECK_ORG && RAM[0x10] == 1, "cpu_request_exit: stopped at the back edge");
+
+	/* the request is dropped when the run returns otherwise */
+	reg->pc = CHECK_ORG + 8;
+	ret = cpu_run(cpu, NULL);
+	check(ret == JIT_RETURN_TRAP, "cpu_request_exit: a trap returns first");
+	check_stop = false;
+	reg->pc = CHECK_ORG;
+	ret = cpu_run_budget(cpu, 50, NULL);
+	check(ret == JIT_RETURN_BUDGET, "cpu_request_exit: the request doesn't outlive its run");
+
+	/* a request before the run stops it before anything runs */
+	RAM[0x10] = 0;
+	reg->pc = CHECK_ORG;
+	cpu_request_exit(cpu);
+	ret = cpu_run(cpu, NULL);
+	check(ret == JIT_RETURN_EXIT && RAM[0x10] == 0, "cpu_request_exit: before cpu_run");
+
+	cpu_free(cpu);
+	free(RAM);
+}
+
+int
+main(int argc, char **argv) {
+	check_dir_create();
+	check_flags();
+	check_liveness();
+	check_fastmem();
+	check_page_walk();
+	check_stack();
+	check_regions();
+	check_rom_cache();
+	check_budget();
+	check_request_exit();
+	check_dir_remove();
+	return check_failures != 0;
+}
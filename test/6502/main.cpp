@@ -78,6 +78,26 @@ kernal_dispatch(
 	unsigned char *s,
 	unsigned char *p); //XXX
 
+/* the KERNAL routines kernal_dispatch implements */
+static const uint16_t kernal_entries[] = {
+	0x0073, 0x0079, 0xFF90, 0xFF99, 0xFF9C, 0xFFB7, 0xFFBA, 0xFFBD,
+	0xFFC0, 0xFFC3, 0xFFC6, 0xFFC9, 0xFFCC, 0xFFCF, 0xFFD2, 0xFFD5,
+	0xFFD8, 0xFFDB, 0xFFDE, 0xFFE1, 0xFFE4, 0xFFE7, 0xFFF0, 0xFFF3
+};
+
+/* called by the translated code instead of returning here */
+static void
+kernal_callout(cpu_t *cpu, addr_t pc, void *opaque) {
+	reg_6502_t *reg = (reg_6502_t*)cpu->rf.grf;
+	uint16_t new_pc = reg->pc;
+
+	kernal_dispatch(cpu->RAM, &new_pc, &reg->a, &reg->x, &reg->y, &reg->s, &reg->p);
+	// do an RTS
+	new_pc = cpu->RAM[0x0100+(++(reg->s))];
+	new_pc |= (cpu->RAM[0x0100+(++(reg->s))]<<8);
+	reg->pc = new_pc + 1;
+}
+
 
 #define SINGLESTEP_NONE	0
 #define SINGLESTEP_STEP	1
@@ -136,6 +156,9 @@ main(int argc, char **argv) {
 
 	cpu->code_entry = RAM[cpu->code_start] | RAM[cpu->code_start+1]<<8; /* start vector at beginning ($A000) */
 
+	for (size_t i = 0; i < sizeof(kernal_entries) / sizeof(kernal_entries[0]); i++)
+		cpu_register_callout(cpu, kernal_entries[i], kernal_callout, NULL);
+
 	cpu_tag(cpu, cpu->code_entry);
 
 	if (entries && *entries == '@')
@@ -6,12 +6,8 @@
 #define START_NO 1000000000
 
 #include <libcpu.h>
-#include "arch/arm/arm_types.h"
-#include "arch/m88k/m88k_isa.h"
 #include <inttypes.h>
 
-#define RET_MAGIC 0x4D495354
-
 static void
 debug_function(cpu_t *cpu) {
 	fprintf(stderr, "%s:%u\n", __FILE__, __LINE__);
@@ -114,47 +110,16 @@ main(int argc, char **argv)
 
 	printf("number of iterations: %u\n", start_no);
 
-	uint32_t *reg_pc, *reg_lr, *reg_param, *reg_result;
-	switch (arch) {
-		case CPU_ARCH_M88K:
-			reg_pc = &((m88k_grf_t*)cpu->rf.grf)->sxip;
-			reg_lr = &((m88k_grf_t*)cpu->rf.grf)->r[1];
-			reg_param = &((m88k_grf_t*)cpu->rf.grf)->r[2];
-			reg_result = &((m88k_grf_t*)cpu->rf.grf)->r[2];
-			break;
-		case CPU_ARCH_MIPS:
-			reg_pc = &((reg_mips32_t*)cpu->rf.grf)->pc;
-			reg_lr = &((reg_mips32_t*)cpu->rf.grf)->r[31];
-			reg_param = &((reg_mips32_t*)cpu->rf.grf)->r[4];
-			reg_result = &((reg_mips32_t*)cpu->rf.grf)->r[4];
-			break;
-		case CPU_ARCH_ARM:
-			reg_pc = &((reg_arm_t*)cpu->rf.grf)->pc;
-			reg_lr = &((reg_arm_t*)cpu->rf.grf)->r[14];
-			reg_param = &((reg_arm_t*)cpu->rf.grf)->r[0];
-			reg_result = &((reg_arm_t*)cpu->rf.grf)->r[0];
-			break;
-		case CPU_ARCH_FAPRA:
-			reg_pc = &((reg_fapra32_t*)cpu->rf.grf)->pc;
-			reg_lr = &((reg_fapra32_t*)cpu->rf.grf)->r[0];
-			reg_param = &((reg_fapra32_t*)cpu->rf.grf)->r[3];
-			reg_result = &((reg_fapra32_t*)cpu->rf.grf)->r[3];
-			break;
-		default:
-			fprintf(stderr, "architecture %u not handled.\n", arch);
-			exit(EXIT_FAILURE);
-	}
-
-	*reg_pc = cpu->code_entry;
-	*reg_lr = RET_MAGIC;
-	*reg_param = start_no;
-
 	printf("GUEST run..."); fflush(stdout);
 
+	uint64_t param = start_no, result = 0;
 	t1 = abs_time();
-	cpu_run(cpu, debug_function);
+	if (cpu_call(cpu, cpu->code_entry, &param, 1, &result, debug_function) != JIT_RETURN_NOERR) {
+		fprintf(stderr, "guest function didn't return.\n");
+		exit(EXIT_FAILURE);
+	}
 	t2 = abs_time();
-	r1 = *reg_result;
+	r1 = (int)result;
 
 	printf("done!\n");
 